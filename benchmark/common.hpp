@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_BENCHMARK_COMMON_HPP
+#define WINTLS_BENCHMARK_COMMON_HPP
+
+#include "certificate.hpp"
+
+#include <wintls.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace net = wintls::net;
+
+// A context using the test certificate, which the server streams of
+// the benchmarks are created with
+struct server_context : public wintls::context {
+  server_context()
+    : wintls::context(wintls::method::system_default) {
+    wintls::error_code dummy;
+    wintls::delete_private_key(key_name(), dummy);
+
+    auto cert_ptr = wintls::x509_to_cert_context(net::buffer(test_certificate), wintls::file_format::pem);
+    wintls::import_private_key(net::buffer(test_key), wintls::file_format::pem, key_name());
+    wintls::assign_private_key(cert_ptr.get(), key_name());
+    use_certificate(cert_ptr.get());
+  }
+
+  ~server_context() {
+    wintls::error_code dummy;
+    wintls::delete_private_key(key_name(), dummy);
+  }
+
+private:
+  static std::string key_name() {
+    return "wintls-benchmark-key";
+  }
+};
+
+// Abort the benchmark if an operation failed
+inline void check(const wintls::error_code& ec) {
+  if (ec) {
+    std::cerr << "Operation failed: " << ec.message() << "\n";
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+inline auto check_handler() {
+  return [](const wintls::error_code& ec) {
+    check(ec);
+  };
+}
+
+#endif // WINTLS_BENCHMARK_COMMON_HPP
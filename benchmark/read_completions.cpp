@@ -0,0 +1,115 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Reports the number of completed async_read_some operations per MiB
+// received for a bulk download over an in memory transport using
+// different buffer policies and read sizes. Reading a record at a
+// time with async_read_record, as async_read_some did before
+// decrypting all complete records buffered, is run as the baseline.
+//
+// Usage: read_completions [MiB to transfer]
+
+#include "common.hpp"
+
+#ifndef WINTLS_USE_STANDALONE_ASIO
+#include <boost/beast/core.hpp>
+#endif // !WINTLS_USE_STANDALONE_ASIO
+
+#include "test_stream/stream.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using test_stream = wintls::test::stream;
+
+namespace {
+
+void print_header() {
+  std::cout << std::left << std::setw(12) << "policy" << std::setw(10) << "read" << std::right << std::setw(12) << "read size" << std::setw(16)
+            << "completions/MiB" << std::setw(10) << "MiB/s"
+            << "\n";
+}
+
+// Reads with async_read_some into a buffer of the given size or, if
+// zero, with async_read_record
+template <class Traits>
+void run(const char* policy, std::size_t mebibytes, std::size_t read_size) {
+  net::io_context ioc;
+  wintls::context client_ctx(wintls::method::system_default);
+  server_context server_ctx;
+
+  wintls::basic_stream<test_stream, Traits> client(ioc, client_ctx);
+  wintls::stream<test_stream> server(ioc, server_ctx);
+  client.next_layer().connect(server.next_layer());
+
+  client.async_handshake(wintls::handshake_type::client, check_handler());
+  server.async_handshake(wintls::handshake_type::server, check_handler());
+  ioc.run();
+  ioc.restart();
+
+  const std::size_t total = mebibytes * 1024 * 1024;
+  const std::vector<char> data(total, 'x');
+  net::async_write(server, net::buffer(data), [](const wintls::error_code& ec, std::size_t) {
+    check(ec);
+  });
+  ioc.run();
+  ioc.restart();
+
+  std::vector<char> buffer(read_size);
+  std::size_t received = 0;
+  std::size_t completions = 0;
+  const auto start = std::chrono::steady_clock::now();
+  while (received < total) {
+    if (read_size == 0) {
+      client.async_read_record([&](const wintls::error_code& ec, net::const_buffer record) {
+        check(ec);
+        received += record.size();
+        ++completions;
+      });
+    } else {
+      client.async_read_some(net::buffer(buffer), [&](const wintls::error_code& ec, std::size_t length) {
+        check(ec);
+        received += length;
+        ++completions;
+      });
+    }
+    ioc.run();
+    ioc.restart();
+  }
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout << std::left << std::setw(12) << policy << std::setw(10) << (read_size == 0 ? "record" : "some") << std::right
+            << std::setw(12) << (read_size == 0 ? std::string("-") : std::to_string(read_size)) << std::setw(16)
+            << completions / mebibytes << std::setw(10) << std::fixed << std::setprecision(1)
+            << static_cast<double>(mebibytes) / elapsed.count() << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  std::size_t mebibytes = 16;
+  if (argc > 1) {
+    mebibytes = std::strtoul(argv[1], nullptr, 10);
+  }
+  if (mebibytes == 0) {
+    return EXIT_FAILURE;
+  }
+
+  const std::size_t read_sizes[] = {0x1000, 0x4000, 0x10000};
+  print_header();
+  run<wintls::default_stream_traits>("default", mebibytes, 0);
+  run<wintls::bulk_transfer_stream_traits>("bulk", mebibytes, 0);
+  for (auto read_size : read_sizes) {
+    run<wintls::default_stream_traits>("default", mebibytes, read_size);
+    run<wintls::bulk_transfer_stream_traits>("bulk", mebibytes, read_size);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Reports the memory used per connection at each stage of the
+// lifetime of a large number of streams connected over an in memory
+// transport.
+//
+// Usage: stream_density [number of connections]...
+
+#include "common.hpp"
+
+#ifndef WINTLS_USE_STANDALONE_ASIO
+#include <boost/beast/core.hpp>
+#endif // !WINTLS_USE_STANDALONE_ASIO
+
+#include "test_stream/stream.hpp"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using test_stream = wintls::test::stream;
+
+namespace {
+
+struct connection {
+  connection(net::io_context& ioc, wintls::context& client_ctx, wintls::context& server_ctx)
+    : client(ioc, client_ctx)
+    , server(ioc, server_ctx) {
+    client.next_layer().connect(server.next_layer());
+  }
+
+  wintls::stream<test_stream> client;
+  wintls::stream<test_stream> server;
+  char client_data[64] = "ping";
+  char server_data[64] = {};
+};
+
+void print_header() {
+  std::cout << std::left << std::setw(12) << "streams" << std::setw(12) << "side" << std::setw(12) << "stage" << std::right
+            << std::setw(10) << "state" << std::setw(12) << "handshake" << std::setw(10) << "decrypt" << std::setw(11)
+            << "plaintext" << std::setw(10) << "encrypt" << std::setw(10) << "cached" << std::setw(10) << "total"
+            << "\n";
+}
+
+void print_usage(std::size_t count, const char* side, const char* stage, const wintls::context& ctx) {
+  const auto usage = ctx.memory_usage();
+  std::cout << std::left << std::setw(12) << count << std::setw(12) << side << std::setw(12) << stage << std::right
+            << std::setw(10) << usage.state / count << std::setw(12) << usage.handshake / count << std::setw(10)
+            << usage.decrypt / count << std::setw(11) << usage.plaintext / count << std::setw(10) << usage.encrypt / count
+            << std::setw(10) << usage.cached / count << std::setw(10) << usage.total() / count << "\n";
+}
+
+void run(std::size_t count) {
+  net::io_context ioc;
+  wintls::context client_ctx(wintls::method::system_default);
+  server_context server_ctx;
+
+  std::vector<std::unique_ptr<connection>> connections;
+  connections.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    connections.push_back(std::make_unique<connection>(ioc, client_ctx, server_ctx));
+  }
+
+  auto report = [&](const char* stage) {
+    print_usage(count, "client", stage, client_ctx);
+    print_usage(count, "server", stage, server_ctx);
+  };
+
+  report("created");
+
+  for (auto& conn : connections) {
+    conn->client.async_handshake(wintls::handshake_type::client, check_handler());
+    conn->server.async_handshake(wintls::handshake_type::server, check_handler());
+  }
+  ioc.run();
+  ioc.restart();
+  report("handshake");
+
+  for (auto& conn : connections) {
+    net::async_write(conn->client, net::buffer(conn->client_data), [](const wintls::error_code& ec, std::size_t) {
+      check(ec);
+    });
+    net::async_read(conn->server, net::buffer(conn->server_data), [](const wintls::error_code& ec, std::size_t) {
+      check(ec);
+    });
+  }
+  ioc.run();
+  ioc.restart();
+  report("data");
+
+  for (auto& conn : connections) {
+    conn->client.shrink_to_fit();
+    conn->server.shrink_to_fit();
+  }
+  report("trimmed");
+
+  for (auto& conn : connections) {
+    conn->client.async_shutdown(check_handler());
+  }
+  ioc.run();
+  report("shutdown");
+
+  connections.clear();
+  report("destroyed");
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  std::vector<std::size_t> counts;
+  for (int i = 1; i < argc; ++i) {
+    counts.push_back(std::strtoul(argv[i], nullptr, 10));
+  }
+  if (counts.empty()) {
+    counts = {1000, 10000, 100000};
+  }
+
+  std::cout << "Bytes per connection\n";
+  print_header();
+  for (auto count : counts) {
+    if (count > 0) {
+      run(count);
+    }
+  }
+  return EXIT_SUCCESS;
+}
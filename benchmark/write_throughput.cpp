@@ -0,0 +1,107 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Reports the number of completed async_write_some operations per MiB
+// sent and the throughput for a bulk upload over a TCP connection on
+// the loopback interface using different buffer policies, with and
+// without pipelining the encryption of the writes.
+//
+// Usage: write_throughput [MiB to transfer]
+
+#include "common.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using tcp = net::ip::tcp;
+
+namespace {
+
+struct pipelined_stream_traits : wintls::default_stream_traits {
+  static constexpr bool pipeline_writes = true;
+};
+
+void print_header() {
+  std::cout << std::left << std::setw(12) << "policy" << std::right << std::setw(16) << "completions/MiB" << std::setw(10)
+            << "MiB/s"
+            << "\n";
+}
+
+template <class Traits>
+void run(const char* policy, std::size_t mebibytes) {
+  net::io_context ioc;
+  wintls::context client_ctx(wintls::method::system_default);
+  server_context server_ctx;
+
+  tcp::acceptor acceptor(ioc, tcp::endpoint(net::ip::address_v4::loopback(), 0));
+  wintls::basic_stream<tcp::socket, Traits> client(ioc, client_ctx);
+  wintls::stream<tcp::socket> server(ioc, server_ctx);
+  client.next_layer().connect(acceptor.local_endpoint());
+  acceptor.accept(server.next_layer());
+
+  client.async_handshake(wintls::handshake_type::client, check_handler());
+  server.async_handshake(wintls::handshake_type::server, check_handler());
+  ioc.run();
+  ioc.restart();
+
+  const std::size_t total = mebibytes * 1024 * 1024;
+  const std::vector<char> data(total, 'x');
+  std::size_t sent = 0;
+  std::size_t completions = 0;
+  std::function<void(const wintls::error_code&, std::size_t)> on_write = [&](const wintls::error_code& ec, std::size_t length) {
+    check(ec);
+    sent += length;
+    ++completions;
+    if (sent < total) {
+      client.async_write_some(net::buffer(data) + sent, on_write);
+    }
+  };
+
+  std::vector<char> buffer(0x10000);
+  std::size_t received = 0;
+  std::function<void(const wintls::error_code&, std::size_t)> on_read = [&](const wintls::error_code& ec, std::size_t length) {
+    check(ec);
+    received += length;
+    if (received < total) {
+      server.async_read_some(net::buffer(buffer), on_read);
+    }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+  client.async_write_some(net::buffer(data), on_write);
+  server.async_read_some(net::buffer(buffer), on_read);
+  ioc.run();
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout << std::left << std::setw(12) << policy << std::right << std::setw(16) << completions / mebibytes
+            << std::setw(10) << std::fixed << std::setprecision(1) << static_cast<double>(mebibytes) / elapsed.count()
+            << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  std::size_t mebibytes = 64;
+  if (argc > 1) {
+    mebibytes = std::strtoul(argv[1], nullptr, 10);
+  }
+  if (mebibytes == 0) {
+    return EXIT_FAILURE;
+  }
+
+  print_header();
+  run<wintls::minimal_memory_stream_traits>("minimal", mebibytes);
+  run<wintls::default_stream_traits>("default", mebibytes);
+  run<pipelined_stream_traits>("pipelined", mebibytes);
+  run<wintls::bulk_transfer_stream_traits>("bulk", mebibytes);
+  return EXIT_SUCCESS;
+}
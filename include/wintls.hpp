@@ -15,6 +15,8 @@
 #include <wintls/error.hpp>
 #include <wintls/file_format.hpp>
 #include <wintls/handshake_type.hpp>
+#include <wintls/memory_usage.hpp>
+#include <wintls/stream_traits.hpp>
 #include <wintls/method.hpp>
 #include <wintls/stream.hpp>
 
@@ -18,9 +18,9 @@ namespace beast {
 
 namespace detail {
 
-template<class AsyncStream>
+template<class AsyncStream, class Traits>
 struct wintls_shutdown_op : boost::asio::coroutine {
-  wintls_shutdown_op(wintls::stream<AsyncStream>& s, role_type role)
+  wintls_shutdown_op(wintls::basic_stream<AsyncStream, Traits>& s, role_type role)
       : s_(s)
       , role_(role) {
   }
@@ -48,21 +48,21 @@ struct wintls_shutdown_op : boost::asio::coroutine {
   }
 
 private:
-  wintls::stream<AsyncStream>& s_;
+  wintls::basic_stream<AsyncStream, Traits>& s_;
   role_type role_;
   error_code ec_;
 };
 
 } // namespace detail
 
-template<class AsyncStream, class TeardownHandler>
-void async_teardown(role_type role, wintls::stream<AsyncStream>& stream, TeardownHandler&& handler) {
+template<class AsyncStream, class Traits, class TeardownHandler>
+void async_teardown(role_type role, wintls::basic_stream<AsyncStream, Traits>& stream, TeardownHandler&& handler) {
   return boost::asio::async_compose<TeardownHandler, void(error_code)>(
-      detail::wintls_shutdown_op<AsyncStream>(stream, role), handler, stream);
+      detail::wintls_shutdown_op<AsyncStream, Traits>(stream, role), handler, stream);
 }
 
-template<class AsyncStream>
-void teardown(boost::beast::role_type role, wintls::stream<AsyncStream>& stream, boost::system::error_code& ec) {
+template<class AsyncStream, class Traits>
+void teardown(boost::beast::role_type role, wintls::basic_stream<AsyncStream, Traits>& stream, boost::system::error_code& ec) {
   stream.shutdown(ec);
   using boost::beast::websocket::teardown;
   boost::system::error_code ec2;
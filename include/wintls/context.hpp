@@ -8,17 +8,21 @@
 #ifndef WINTLS_CONTEXT_HPP
 #define WINTLS_CONTEXT_HPP
 
+#include <wintls/memory_usage.hpp>
 #include <wintls/method.hpp>
 
+#include <wintls/detail/buffer_pool.hpp>
 #include <wintls/detail/config.hpp>
 #include <wintls/detail/context_certificates.hpp>
 
+#include <cstddef>
 #include <string>
 
 namespace wintls {
 
 namespace detail {
 class sspi_handshake;
+class sspi_stream;
 }
 
 class context {
@@ -134,6 +138,78 @@ public:
     }
   }
 
+  /** Set the maximum size of the handshake buffer
+   *
+   * Data received from the peer during the handshake is buffered
+   * until a complete handshake message is available. The buffer
+   * starts out small and grows on demand when the peer sends large
+   * messages, like long certificate chains, but never beyond this
+   * limit. The buffer is released once the handshake is done.
+   *
+   * A handshake requiring more buffer space than this fails with
+   * `SEC_E_BUFFER_TOO_SMALL`.
+   *
+   * @param max_size The maximum size in bytes of the buffer used by
+   * each @ref stream during the handshake. Defaults to 256 KiB.
+   */
+  void set_handshake_buffer_limit(std::size_t max_size) {
+    handshake_buffer_limit_ = max_size;
+  }
+
+  /** Set the number of buffers cached for reuse
+   *
+   * The buffers used by each @ref stream for handshaking and for
+   * holding TLS records are allocated from a pool shared by all
+   * streams using this context. When a stream releases a buffer it
+   * is kept in a free list local to the releasing thread so it can be
+   * handed out again without going through the heap or taking any
+   * locks.
+   *
+   * Buffers cached by other threads when the context is destroyed
+   * are freed by those threads the next time they use any context,
+   * or when they exit. Until then they keep at most `max_buffers`
+   * buffers in total.
+   *
+   * @param max_buffers The maximum number of unused buffers kept by
+   * this context across all threads. Defaults to 256.
+   */
+  void set_buffer_cache_limit(std::size_t max_buffers) {
+    buffer_pool_.set_cache_limit(max_buffers);
+  }
+
+  /** Get the number of buffers in use
+   *
+   * @return The number of buffers currently handed out to streams
+   * using this context.
+   */
+  std::size_t buffers_in_use() const {
+    return buffer_pool_.in_use();
+  }
+
+  /** Get the number of cached buffers
+   *
+   * @return The number of unused buffers currently kept for reuse
+   * by this context.
+   */
+  std::size_t buffers_cached() const {
+    return buffer_pool_.cached();
+  }
+
+  /** Get the memory used by streams using this context.
+   *
+   * Aggregates the memory used by all streams currently using this
+   * context, as reported by @ref basic_stream::memory_usage for each of
+   * them, as well as the unused buffers kept for reuse.
+   *
+   * Streams constructed with an allocator don't allocate from the
+   * context and are not included.
+   *
+   * @return The memory used in bytes.
+   */
+  wintls::memory_usage memory_usage() const {
+    return buffer_pool_.memory_usage();
+  }
+
 private:
   DWORD verify_certificate(const CERT_CONTEXT* cert, const std::string& server_hostname, bool check_revocation) {
     if (!verify_server_certificate_) {
@@ -147,10 +223,13 @@ private:
   }
 
   friend class detail::sspi_handshake;
+  friend class detail::sspi_stream;
 
   detail::context_certificates ctx_certs_;
   method method_;
   bool verify_server_certificate_;
+  std::size_t handshake_buffer_limit_ = 0x40000;
+  detail::buffer_pool buffer_pool_;
 };
 
 } // namespace wintls
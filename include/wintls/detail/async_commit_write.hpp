@@ -0,0 +1,68 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_ASYNC_COMMIT_WRITE_HPP
+#define WINTLS_DETAIL_ASYNC_COMMIT_WRITE_HPP
+
+#include <wintls/detail/config.hpp>
+#include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/immediate_completion.hpp>
+#include <wintls/detail/sspi_encrypt.hpp>
+
+namespace wintls {
+namespace detail {
+
+template <typename NextLayer>
+struct async_commit_write : net::coroutine {
+  async_commit_write(NextLayer& next_layer, std::size_t size, detail::sspi_encrypt& encrypt)
+    : next_layer_(next_layer)
+    , size_(size)
+    , encrypt_(encrypt) {
+  }
+
+  template <typename Self>
+  void operator()(Self& self, wintls::error_code ec = {}, std::size_t length = 0) {
+    (void)(length);
+    WINTLS_ASIO_CORO_REENTER(*this) {
+      if (!encrypt_.prepared()) {
+        // No operation was begun by prepare_write, so none is ended here
+        error_ = net::error::invalid_argument;
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+        self.complete(error_, 0);
+        return;
+      }
+
+      bytes_consumed_ = encrypt_.encrypt_prepared(size_, error_);
+      if (error_) {
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+      } else {
+        WINTLS_ASIO_CORO_YIELD {
+          net::async_write(next_layer_, encrypt_.buffers.encrypted_data(), detail::transfer_all_records{}, std::move(self));
+        }
+        error_ = ec;
+      }
+      encrypt_.end_operation();
+      self.complete(error_, error_ ? 0 : bytes_consumed_);
+    }
+  }
+
+private:
+  NextLayer& next_layer_;
+  std::size_t size_;
+  detail::sspi_encrypt& encrypt_;
+  size_t bytes_consumed_{0};
+  wintls::error_code error_{};
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_ASYNC_COMMIT_WRITE_HPP
@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_ASYNC_FLUSH_HPP
+#define WINTLS_DETAIL_ASYNC_FLUSH_HPP
+
+#include <wintls/detail/config.hpp>
+#include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/immediate_completion.hpp>
+#include <wintls/detail/sspi_encrypt.hpp>
+
+namespace wintls {
+namespace detail {
+
+template <typename NextLayer>
+struct async_flush : net::coroutine {
+  async_flush(NextLayer& next_layer, detail::sspi_encrypt& encrypt)
+    : next_layer_(next_layer)
+    , encrypt_(encrypt)
+    , entry_count_(0) {
+  }
+
+  template <typename Self>
+  void operator()(Self& self, wintls::error_code ec = {}, std::size_t length = 0) {
+    (void)(length);
+    if (ec) {
+      encrypt_.end_operation();
+      self.complete(ec);
+      return;
+    }
+
+    ++entry_count_;
+    auto is_continuation = [this] {
+      return entry_count_ > 1;
+    };
+
+    WINTLS_ASIO_CORO_REENTER(*this) {
+      while (encrypt_.flush_pending) {
+        WINTLS_ASIO_CORO_YIELD {
+          encrypt_.wait_for_flush(self);
+        }
+      }
+
+      encrypt_.begin_operation();
+      if (encrypt_.flush(error_)) {
+        WINTLS_ASIO_CORO_YIELD {
+          net::async_write(next_layer_, encrypt_.buffers.encrypted_data(), detail::transfer_all_records{}, std::move(self));
+        }
+      } else if (!is_continuation()) {
+        // Nothing corked
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+      }
+
+      encrypt_.end_operation();
+      self.complete(error_);
+    }
+  }
+
+private:
+  NextLayer& next_layer_;
+  detail::sspi_encrypt& encrypt_;
+  int entry_count_;
+  wintls::error_code error_;
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_ASYNC_FLUSH_HPP
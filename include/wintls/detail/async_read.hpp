@@ -10,6 +10,7 @@
 
 #include <wintls/detail/config.hpp>
 #include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/immediate_completion.hpp>
 #include <wintls/detail/sspi_decrypt.hpp>
 
 namespace wintls {
@@ -21,13 +22,15 @@ struct async_read : net::coroutine {
     : next_layer_(next_layer)
     , buffers_(buffers)
     , decrypt_(decrypt)
-    , entry_count_(0) {
+    , entry_count_(0)
+    , state_(detail::sspi_decrypt::state::data_needed) {
   }
 
   template <typename Self>
-  void operator()(Self& self, wintls::error_code ec = {}, std::size_t size_read = 0) {
+  void operator()(Self& self, wintls::error_code ec = {}, std::size_t length = 0) {
     if (ec) {
-      self.complete(ec, size_read);
+      decrypt_.end_operation();
+      self.complete(ec, length);
       return;
     }
 
@@ -36,28 +39,45 @@ struct async_read : net::coroutine {
       return entry_count_ > 1;
     };
 
-    detail::sspi_decrypt::state state;
     WINTLS_ASIO_CORO_REENTER(*this) {
-      while((state = decrypt_(buffers_)) == detail::sspi_decrypt::state::data_needed) {
-        WINTLS_ASIO_CORO_YIELD {
-          next_layer_.async_read_some(decrypt_.input_buffer, std::move(self));
+      decrypt_.begin_operation();
+      for (;;) {
+        state_ = decrypt_(buffers_);
+        if (state_ == detail::sspi_decrypt::state::data_needed) {
+          WINTLS_ASIO_CORO_YIELD {
+            next_layer_.async_read_some(decrypt_.input_buffer, std::move(self));
+          }
+          decrypt_.size_read(length);
+          continue;
         }
-        decrypt_.size_read(size_read);
-        continue;
-      }
-
-      if (state == detail::sspi_decrypt::state::error) {
-        if (!is_continuation()) {
+        if (state_ == detail::sspi_decrypt::state::data_to_write) {
+          // Respond to a post handshake message from the peer
           WINTLS_ASIO_CORO_YIELD {
-            auto e = self.get_executor();
-            net::post(e, [self = std::move(self), ec, size_read]() mutable { self(ec, size_read); });
+            net::async_write(next_layer_, decrypt_.output_buffer(), std::move(self));
           }
+          decrypt_.size_written(length);
+          continue;
         }
+        break;
+      }
+
+      if (!is_continuation()) {
+        // Completed without any I/O, typically by delivering data
+        // already decrypted. The handler is never invoked from within
+        // the initiating function.
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+      }
+
+      if (state_ == detail::sspi_decrypt::state::error) {
         ec = decrypt_.last_error();
+        decrypt_.end_operation();
         self.complete(ec, 0);
         return;
       }
 
+      decrypt_.end_operation();
       self.complete(wintls::error_code{}, decrypt_.size_decrypted);
     }
   }
@@ -67,6 +87,7 @@ private:
   MutableBufferSequence buffers_;
   detail::sspi_decrypt& decrypt_;
   int entry_count_;
+  detail::sspi_decrypt::state state_;
 };
 
 } // namespace detail
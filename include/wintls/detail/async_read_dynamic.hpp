@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_ASYNC_READ_DYNAMIC_HPP
+#define WINTLS_DETAIL_ASYNC_READ_DYNAMIC_HPP
+
+#include <wintls/detail/async_read.hpp>
+#include <wintls/detail/config.hpp>
+#include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/immediate_completion.hpp>
+#include <wintls/detail/sspi_decrypt.hpp>
+
+#include <algorithm>
+
+namespace wintls {
+namespace detail {
+
+// The number of bytes to grow a dynamic buffer by for a single read
+template <typename DynamicBuffer>
+std::size_t dynamic_read_size(const DynamicBuffer& buffers, sspi_decrypt& decrypt) {
+  return std::min(decrypt.read_size_hint(), buffers.max_size() - buffers.size());
+}
+
+template <typename NextLayer, typename DynamicBuffer>
+struct async_read_dynamic : net::coroutine {
+  async_read_dynamic(NextLayer& next_layer, DynamicBuffer buffers, detail::sspi_decrypt& decrypt)
+    : next_layer_(next_layer)
+    , buffers_(std::move(buffers))
+    , decrypt_(decrypt) {
+  }
+
+  template <typename Self>
+  void operator()(Self& self, wintls::error_code ec = {}, std::size_t size_read = 0) {
+    WINTLS_ASIO_CORO_REENTER(*this) {
+      size_ = dynamic_read_size(buffers_, decrypt_);
+      if (size_ == 0) {
+        // The dynamic buffer is full
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+        self.complete(net::error::no_buffer_space, 0);
+        return;
+      }
+
+      position_ = buffers_.size();
+      buffers_.grow(size_);
+      WINTLS_ASIO_CORO_YIELD {
+        using buffers_type = typename DynamicBuffer::mutable_buffers_type;
+        auto buffers = buffers_.data(position_, size_);
+        net::async_compose<Self, void(wintls::error_code, std::size_t)>(
+            detail::async_read<NextLayer, buffers_type>{next_layer_, buffers, decrypt_}, self, next_layer_);
+      }
+      if (ec) {
+        size_read = 0;
+      }
+      buffers_.shrink(size_ - size_read);
+      self.complete(ec, size_read);
+    }
+  }
+
+private:
+  NextLayer& next_layer_;
+  DynamicBuffer buffers_;
+  detail::sspi_decrypt& decrypt_;
+  std::size_t size_{0};
+  std::size_t position_{0};
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_ASYNC_READ_DYNAMIC_HPP
@@ -0,0 +1,92 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_ASYNC_READ_RECORD_HPP
+#define WINTLS_DETAIL_ASYNC_READ_RECORD_HPP
+
+#include <wintls/detail/config.hpp>
+#include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/immediate_completion.hpp>
+#include <wintls/detail/sspi_decrypt.hpp>
+
+namespace wintls {
+namespace detail {
+
+template <typename NextLayer>
+struct async_read_record : net::coroutine {
+  async_read_record(NextLayer& next_layer, detail::sspi_decrypt& decrypt)
+    : next_layer_(next_layer)
+    , decrypt_(decrypt)
+    , entry_count_(0)
+    , state_(detail::sspi_decrypt::state::data_needed) {
+  }
+
+  template <typename Self>
+  void operator()(Self& self, wintls::error_code ec = {}, std::size_t length = 0) {
+    if (ec) {
+      decrypt_.end_operation();
+      self.complete(ec, net::const_buffer{});
+      return;
+    }
+
+    ++entry_count_;
+    auto is_continuation = [this] {
+      return entry_count_ > 1;
+    };
+
+    WINTLS_ASIO_CORO_REENTER(*this) {
+      decrypt_.begin_operation();
+      for (;;) {
+        state_ = decrypt_.read_record();
+        if (state_ == detail::sspi_decrypt::state::data_needed) {
+          WINTLS_ASIO_CORO_YIELD {
+            next_layer_.async_read_some(decrypt_.input_buffer, std::move(self));
+          }
+          decrypt_.size_read(length);
+          continue;
+        }
+        if (state_ == detail::sspi_decrypt::state::data_to_write) {
+          // Respond to a post handshake message from the peer
+          WINTLS_ASIO_CORO_YIELD {
+            net::async_write(next_layer_, decrypt_.output_buffer(), std::move(self));
+          }
+          decrypt_.size_written(length);
+          continue;
+        }
+        break;
+      }
+
+      if (!is_continuation()) {
+        // Completed without any I/O from records already received
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+      }
+
+      if (state_ == detail::sspi_decrypt::state::error) {
+        ec = decrypt_.last_error();
+        decrypt_.end_operation();
+        self.complete(ec, net::const_buffer{});
+        return;
+      }
+
+      decrypt_.end_operation();
+      self.complete(wintls::error_code{}, decrypt_.record);
+    }
+  }
+
+private:
+  NextLayer& next_layer_;
+  detail::sspi_decrypt& decrypt_;
+  int entry_count_;
+  detail::sspi_decrypt::state state_;
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_ASYNC_READ_RECORD_HPP
@@ -10,6 +10,7 @@
 
 #include <wintls/detail/config.hpp>
 #include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/sspi_encrypt.hpp>
 #include <wintls/detail/sspi_shutdown.hpp>
 
 namespace wintls {
@@ -17,15 +18,19 @@ namespace detail {
 
 template <typename NextLayer>
 struct async_shutdown : net::coroutine {
-  async_shutdown(NextLayer& next_layer, detail::sspi_shutdown& shutdown)
+  async_shutdown(NextLayer& next_layer, detail::sspi_shutdown& shutdown, detail::sspi_encrypt& encrypt)
     : next_layer_(next_layer)
     , shutdown_(shutdown)
+    , encrypt_(encrypt)
     , entry_count_(0) {
   }
 
   template <typename Self>
   void operator()(Self& self, wintls::error_code ec = {}, std::size_t size_written = 0) {
     if (ec) {
+      if (flushing_) {
+        encrypt_.end_operation();
+      }
       self.complete(ec);
       return;
     }
@@ -35,10 +40,36 @@ struct async_shutdown : net::coroutine {
       return entry_count_ > 1;
     };
 
-    ec = shutdown_();
-
     WINTLS_ASIO_CORO_REENTER(*this) {
-      if (!ec) {
+      // Records still being written in the background go first
+      while (encrypt_.flush_pending) {
+        WINTLS_ASIO_CORO_YIELD {
+          encrypt_.wait_for_flush(self);
+        }
+      }
+
+      // A write in the background which failed is reported instead of
+      // shutting down
+      error_ = encrypt_.flush_error;
+      encrypt_.flush_error = {};
+
+      // Data still corked goes ahead of the close_notify
+      if (!error_ && encrypt_.corked_size() != 0) {
+        encrypt_.begin_operation();
+        flushing_ = true;
+        if (encrypt_.flush(error_)) {
+          WINTLS_ASIO_CORO_YIELD {
+            net::async_write(next_layer_, encrypt_.buffers.encrypted_data(), detail::transfer_all_records{}, std::move(self));
+          }
+        }
+        flushing_ = false;
+        encrypt_.end_operation();
+      }
+
+      if (!error_) {
+        error_ = shutdown_();
+      }
+      if (!error_) {
         WINTLS_ASIO_CORO_YIELD {
           net::async_write(next_layer_, shutdown_.buffer(), std::move(self));
         }
@@ -49,10 +80,10 @@ struct async_shutdown : net::coroutine {
         if (!is_continuation()) {
           WINTLS_ASIO_CORO_YIELD {
             auto e = self.get_executor();
-            net::post(e, [self = std::move(self), ec, size_written]() mutable { self(ec, size_written); });
+            net::post(e, [self = std::move(self), ec = error_, size_written]() mutable { self(ec, size_written); });
           }
         }
-        self.complete(ec);
+        self.complete(error_);
         return;
       }
     }
@@ -61,7 +92,10 @@ struct async_shutdown : net::coroutine {
 private:
   NextLayer& next_layer_;
   detail::sspi_shutdown& shutdown_;
+  detail::sspi_encrypt& encrypt_;
   int entry_count_;
+  bool flushing_{false};
+  wintls::error_code error_;
 };
 
 } // namespace detail
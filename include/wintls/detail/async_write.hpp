@@ -10,7 +10,9 @@
 
 #include <wintls/detail/config.hpp>
 #include <wintls/detail/coroutine.hpp>
+#include <wintls/detail/immediate_completion.hpp>
 #include <wintls/detail/sspi_encrypt.hpp>
+#include <wintls/detail/write_queue.hpp>
 
 namespace wintls {
 namespace detail {
@@ -20,31 +22,179 @@ struct async_write : net::coroutine {
   async_write(NextLayer& next_layer, const ConstBufferSequence& buffer, detail::sspi_encrypt& encrypt)
     : next_layer_(next_layer)
     , buffer_(buffer)
-    , encrypt_(encrypt) {
+    , encrypt_(encrypt)
+    , entry_count_(0)
+    , queued_(encrypt.queue.enabled) {
+  }
+
+  template <typename Self>
+  void operator()(Self& self, detail::write_queue::take_over) {
+    writer_ = true;
+    (*this)(self);
   }
 
   template <typename Self>
   void operator()(Self& self, wintls::error_code ec = {}, std::size_t length = 0) {
+    if (queued_) {
+      queued_write(self, ec, length);
+      return;
+    }
+
     (void)(length);
+    if (ec) {
+      encrypt_.end_operation();
+      self.complete(ec, 0);
+      return;
+    }
+
+    ++entry_count_;
+    auto is_continuation = [this] {
+      return entry_count_ > 1;
+    };
+
     WINTLS_ASIO_CORO_REENTER(*this) {
-      bytes_consumed_ = encrypt_(buffer_, ec);
-      if (ec) {
-        self.complete(ec, 0);
-        return;
+      // A pipelined write encrypts its data while the write behind of
+      // the previous one is still in progress
+      pipelined_ = encrypt_.pipelined();
+      while (encrypt_.flush_pending && !(pipelined_ && encrypt_.writing_behind())) {
+        WINTLS_ASIO_CORO_YIELD {
+          encrypt_.wait_for_flush(self);
+        }
       }
 
-      WINTLS_ASIO_CORO_YIELD {
-        net::async_write(next_layer_, encrypt_.buffers, std::move(self));
+      encrypt_.begin_operation();
+      bytes_consumed_ = encrypt_.write(buffer_, ready_, error_);
+      if (pipelined_ && ready_) {
+        while (encrypt_.flush_pending) {
+          WINTLS_ASIO_CORO_YIELD {
+            encrypt_.wait_for_flush(self);
+          }
+        }
+        if (encrypt_.flush_error) {
+          // The previous write failed in the meantime
+          error_ = encrypt_.flush_error;
+          encrypt_.flush_error = {};
+        } else {
+          // Completed once the write has been started
+          encrypt_.write_behind(next_layer_, self.get_executor());
+        }
+        ready_ = false;
       }
-      self.complete(ec, bytes_consumed_);
+      if (ready_) {
+        WINTLS_ASIO_CORO_YIELD {
+          net::async_write(next_layer_, encrypt_.buffers.encrypted_data(), detail::transfer_all_records{}, std::move(self));
+        }
+      } else if (!is_continuation()) {
+        // Corked or written behind without waiting
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+      }
+
+      encrypt_.end_operation();
+      if (error_) {
+        self.complete(error_, 0);
+        return;
+      }
+      encrypt_.schedule_flush(self.get_executor());
+      self.complete(wintls::error_code{}, bytes_consumed_);
     }
   }
 
 private:
+  // Write all of the data, either right away or after the writes
+  // queued before it. The writer encrypts the data of all the writes
+  // queued when it starts into as few records as possible and
+  // completes each of them once written.
+  template <typename Self>
+  void queued_write(Self& self, const wintls::error_code& ec, std::size_t length) {
+    ++entry_count_;
+    auto is_continuation = [this] {
+      return entry_count_ > 1;
+    };
+
+    WINTLS_ASIO_CORO_REENTER(*this) {
+      if (encrypt_.queue.busy) {
+        WINTLS_ASIO_CORO_YIELD {
+          encrypt_.queue.push(self, buffer_);
+        }
+        if (!writer_) {
+          // Written by another operation
+          self.complete(ec, length);
+          return;
+        }
+      }
+      encrypt_.queue.busy = true;
+
+      while (encrypt_.flush_pending) {
+        WINTLS_ASIO_CORO_YIELD {
+          encrypt_.wait_for_flush(self);
+        }
+      }
+
+      encrypt_.begin_operation();
+      // Data corked by earlier writes goes first
+      if (encrypt_.flush(error_)) {
+        WINTLS_ASIO_CORO_YIELD {
+          net::async_write(next_layer_, encrypt_.buffers.encrypted_data(), detail::transfer_all_records{}, std::move(self));
+        }
+        error_ = ec;
+      }
+
+      batch_ = encrypt_.queue.take();
+      batch_size_ = net::buffer_size(buffer_);
+      if (!batch_.empty()) {
+        encrypt_.queue.gather(buffer_, batch_);
+        batch_size_ = net::buffer_size(encrypt_.queue.gathered);
+      }
+
+      bytes_consumed_ = 0;
+      while (!error_ && bytes_consumed_ < batch_size_) {
+        bytes_consumed_ += encrypt_batch();
+        if (error_) {
+          break;
+        }
+        WINTLS_ASIO_CORO_YIELD {
+          net::async_write(next_layer_, encrypt_.buffers.encrypted_data(), detail::transfer_all_records{}, std::move(self));
+        }
+        error_ = ec;
+      }
+      encrypt_.end_operation();
+
+      batch_.complete(error_);
+      encrypt_.queue.next();
+
+      if (!is_continuation()) {
+        // Nothing to write
+        WINTLS_ASIO_CORO_YIELD {
+          detail::complete_immediately(self);
+        }
+      }
+      self.complete(error_, error_ ? 0 : net::buffer_size(buffer_));
+    }
+  }
+
+  // Encrypt the data of this write alone or gathered along with the
+  // data of the queued writes taken
+  std::size_t encrypt_batch() {
+    if (batch_.empty()) {
+      return encrypt_(buffer_, bytes_consumed_, error_);
+    }
+    return encrypt_(encrypt_.queue.gathered, bytes_consumed_, error_);
+  }
+
   NextLayer& next_layer_;
   ConstBufferSequence buffer_;
   detail::sspi_encrypt& encrypt_;
+  int entry_count_;
+  bool ready_{false};
+  wintls::error_code error_;
   size_t bytes_consumed_{0};
+  bool pipelined_{false};
+  const bool queued_;
+  bool writer_{false};
+  detail::write_queue::entries batch_;
+  size_t batch_size_{0};
 };
 
 } // detail
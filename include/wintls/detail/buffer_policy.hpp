@@ -0,0 +1,43 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_BUFFER_POLICY_HPP
+#define WINTLS_DETAIL_BUFFER_POLICY_HPP
+
+#include <cstddef>
+
+namespace wintls {
+namespace detail {
+
+// The buffer policy given by the traits of a stream, passed on to
+// the non-template parts of the implementation.
+struct buffer_policy {
+  std::size_t handshake_buffer_size;
+  std::size_t record_buffer_size;
+  std::size_t max_record_buffer_size;
+  bool copy_plaintext;
+  std::size_t max_write_size;
+  bool pipeline_writes;
+};
+
+template <class Traits>
+constexpr buffer_policy make_buffer_policy() {
+  static_assert(Traits::handshake_buffer_size > 0, "handshake buffer size must be non-zero");
+  static_assert(Traits::record_buffer_size <= Traits::max_record_buffer_size,
+                "record buffer size must not exceed the maximum record buffer size");
+  return buffer_policy{Traits::handshake_buffer_size,
+                       Traits::record_buffer_size,
+                       Traits::max_record_buffer_size,
+                       Traits::copy_plaintext,
+                       Traits::max_write_size,
+                       Traits::pipeline_writes};
+}
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_BUFFER_POLICY_HPP
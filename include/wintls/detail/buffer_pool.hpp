@@ -0,0 +1,471 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_BUFFER_POOL_HPP
+#define WINTLS_DETAIL_BUFFER_POOL_HPP
+
+#include <wintls/memory_usage.hpp>
+
+#include <wintls/detail/config.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace wintls {
+namespace detail {
+
+// What a buffer is used for
+enum class buffer_kind {
+  handshake,
+  decrypt,
+  plaintext,
+  encrypt
+};
+
+// Source of the buffers used by a stream
+class buffer_allocator {
+public:
+  virtual void* allocate(std::size_t size, buffer_kind kind) = 0;
+  virtual void deallocate(void* ptr, std::size_t size, buffer_kind kind) = 0;
+
+  // Allocate state of the stream shared with the handlers of
+  // operations which may complete after the stream has been
+  // destroyed, such as a delayed flush. The state is allocated the
+  // same way as the stream and freed once the last reference to it,
+  // weak or not, is gone.
+  template <class T, class... Args>
+  std::shared_ptr<T> make_shared_state(Args&&... args) {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned shared state");
+    void* storage = allocate_state(sizeof(T));
+    T* state = nullptr;
+    try {
+      state = new (storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      deallocate_state(storage, sizeof(T));
+      throw;
+    }
+    return std::static_pointer_cast<T>(share_state(state, sizeof(T), &destroy_state<T>));
+  }
+
+  // An allocator for freeing buffers allocated by this one after it
+  // may have been destroyed along with the stream, like the records
+  // of a write still in progress when the stream is destroyed
+  virtual std::shared_ptr<buffer_allocator> share() = 0;
+
+protected:
+  ~buffer_allocator() = default;
+
+  // Shared state of streams allocated from the context is allocated
+  // on the heap, like the streams themselves
+  virtual void* allocate_state(std::size_t size) {
+    return ::operator new(size);
+  }
+
+  virtual void deallocate_state(void* ptr, std::size_t) {
+    ::operator delete(ptr);
+  }
+
+  // Take ownership of the constructed state, which is destroyed by
+  // the given function before its storage is freed. The control block
+  // as well as the deleter freeing the state must not refer to this
+  // object, which may be gone by then.
+  virtual std::shared_ptr<void> share_state(void* state, std::size_t, void (*destroy)(void*)) {
+    return std::shared_ptr<void>(state, [destroy](void* ptr) {
+      destroy(ptr);
+      ::operator delete(ptr);
+    });
+  }
+
+private:
+  template <class T>
+  static void destroy_state(void* ptr) {
+    static_cast<T*>(ptr)->~T();
+  }
+};
+
+// Buffers allocated using a standard allocator
+template <class Allocator>
+class basic_buffer_allocator final : public buffer_allocator {
+  using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<char>;
+  using traits_type = std::allocator_traits<allocator_type>;
+
+public:
+  explicit basic_buffer_allocator(const Allocator& alloc)
+    : alloc_(alloc) {
+  }
+
+  void* allocate(std::size_t size, buffer_kind) override {
+    return traits_type::allocate(alloc_, size);
+  }
+
+  void deallocate(void* ptr, std::size_t size, buffer_kind) override {
+    traits_type::deallocate(alloc_, static_cast<char*>(ptr), size);
+  }
+
+  // A copy of this allocator allocated as shared state
+  std::shared_ptr<buffer_allocator> share() override {
+    return make_shared_state<basic_buffer_allocator>(Allocator(alloc_));
+  }
+
+private:
+  // Shared state is allocated in units of the strictest fundamental
+  // alignment, using a copy of the allocator kept by the shared
+  // pointer as this object may be destroyed before the state
+  using state_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<std::max_align_t>;
+  using state_traits_type = std::allocator_traits<state_allocator_type>;
+
+  static std::size_t state_units(std::size_t size) {
+    return (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  }
+
+  void* allocate_state(std::size_t size) override {
+    state_allocator_type alloc(alloc_);
+    return state_traits_type::allocate(alloc, state_units(size));
+  }
+
+  void deallocate_state(void* ptr, std::size_t size) override {
+    state_allocator_type alloc(alloc_);
+    state_traits_type::deallocate(alloc, static_cast<std::max_align_t*>(ptr), state_units(size));
+  }
+
+  std::shared_ptr<void> share_state(void* state, std::size_t size, void (*destroy)(void*)) override {
+    state_allocator_type alloc(alloc_);
+    return std::shared_ptr<void>(state, [alloc, size, destroy](void* ptr) mutable {
+      destroy(ptr);
+      state_traits_type::deallocate(alloc, static_cast<std::max_align_t*>(ptr), state_units(size));
+    }, alloc);
+  }
+
+  allocator_type alloc_;
+};
+
+// Pool of fixed size buffers shared by all streams using the same
+// context.
+//
+// Released buffers are cached in free lists local to the releasing
+// thread, keyed by the exact buffer size, so allocating and releasing
+// buffers never takes a lock. Only the statistics are shared between
+// threads. Buffers cached by a thread for a pool which has since been
+// destroyed are freed the next time that thread uses any pool, or
+// when it exits. Freeing them from the destroying thread would need a
+// lock on every cache access, so a thread which never uses a pool
+// again keeps them until it exits. As the cache limit applies to all
+// threads together, that is never more than the limit of the pool
+// when destroyed, in buffers of at most the largest size it handed
+// out.
+class buffer_pool final : public buffer_allocator {
+  struct pool_state {
+    std::atomic<std::size_t> in_use{0};
+    std::atomic<std::size_t> cached{0};
+    std::atomic<std::size_t> cache_limit{256};
+    std::atomic<std::size_t> bytes_in_use[4] = {};
+    std::atomic<std::size_t> bytes_cached{0};
+    std::atomic<std::size_t> state_bytes{0};
+    std::atomic<bool> alive{true};
+  };
+
+  struct free_list {
+    std::size_t size;
+    std::vector<void*> buffers;
+  };
+
+  struct cache_entry {
+    std::shared_ptr<pool_state> state;
+    std::vector<free_list> free_lists;
+  };
+
+  class thread_cache {
+  public:
+    ~thread_cache() {
+      for (auto& entry : entries_) {
+        clear(*entry);
+      }
+      destroyed() = true;
+    }
+
+    // Set once the cache of the calling thread has been destroyed.
+    // Trivially destructible, so it can still be checked by pools and
+    // streams with static storage duration destroyed after the thread
+    // locals of the main thread.
+    static bool& destroyed() {
+      static thread_local bool value = false;
+      return value;
+    }
+
+    cache_entry& get(const std::shared_ptr<pool_state>& state) {
+      const std::size_t retired = retired_pools().load(std::memory_order_acquire);
+      if (retired != retired_seen_) {
+        retired_seen_ = retired;
+        purge();
+      }
+      for (auto& entry : entries_) {
+        if (entry->state == state) {
+          return *entry;
+        }
+      }
+      entries_.push_back(std::make_unique<cache_entry>());
+      entries_.back()->state = state;
+      return *entries_.back();
+    }
+
+    // Free whatever is left over from pools which no longer exist
+    void purge() {
+      for (auto it = entries_.begin(); it != entries_.end();) {
+        if (!(*it)->state->alive) {
+          clear(**it);
+          it = entries_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+  private:
+    static void clear(cache_entry& entry) {
+      for (auto& list : entry.free_lists) {
+        for (auto ptr : list.buffers) {
+          ::operator delete(ptr);
+        }
+        entry.state->cached -= list.buffers.size();
+        entry.state->bytes_cached -= list.buffers.size() * list.size;
+        list.buffers.clear();
+      }
+    }
+
+    std::vector<std::unique_ptr<cache_entry>> entries_;
+    std::size_t retired_seen_ = 0;
+  };
+
+  // The number of pools destroyed so far, letting each thread know
+  // when to free what it has cached for them
+  static std::atomic<std::size_t>& retired_pools() {
+    static std::atomic<std::size_t> count{0};
+    return count;
+  }
+
+  // The cache of the calling thread, or null once it has been
+  // destroyed, in which case buffers are no longer cached
+  static thread_cache* local_cache() {
+    if (thread_cache::destroyed()) {
+      return nullptr;
+    }
+    static thread_local thread_cache cache;
+    return &cache;
+  }
+
+  static free_list& find_free_list(cache_entry& entry, std::size_t size) {
+    auto it = std::find_if(entry.free_lists.begin(), entry.free_lists.end(), [size](const free_list& list) {
+      return list.size == size;
+    });
+    if (it != entry.free_lists.end()) {
+      return *it;
+    }
+    entry.free_lists.push_back(free_list{size, {}});
+    return entry.free_lists.back();
+  }
+
+public:
+  buffer_pool()
+    : state_(std::make_shared<pool_state>()) {
+  }
+
+  // The moved from pool starts over with a state of its own, as the
+  // streams using a pool refer to the pool and not its state
+  buffer_pool(buffer_pool&& other)
+    : state_(std::move(other.state_)) {
+    other.state_ = std::make_shared<pool_state>();
+  }
+
+  buffer_pool& operator=(buffer_pool&& other) {
+    if (this != &other) {
+      retire();
+      state_ = std::move(other.state_);
+      other.state_ = std::make_shared<pool_state>();
+    }
+    return *this;
+  }
+
+  ~buffer_pool() {
+    retire();
+  }
+
+  void* allocate(std::size_t size, buffer_kind kind) override {
+    thread_cache* cache = local_cache();
+    free_list* list = cache ? &find_free_list(cache->get(state_), size) : nullptr;
+    void* ptr = nullptr;
+    if (list && !list->buffers.empty()) {
+      ptr = list->buffers.back();
+      list->buffers.pop_back();
+      --state_->cached;
+      state_->bytes_cached -= size;
+    } else {
+      ptr = ::operator new(size);
+    }
+    ++state_->in_use;
+    state_->bytes_in_use[static_cast<std::size_t>(kind)] += size;
+    return ptr;
+  }
+
+  void deallocate(void* ptr, std::size_t size, buffer_kind kind) override {
+    --state_->in_use;
+    state_->bytes_in_use[static_cast<std::size_t>(kind)] -= size;
+    thread_cache* cache = local_cache();
+    // Reserve a place in the cache before caching the buffer, so
+    // buffers released concurrently never exceed the limit
+    if (cache && state_->cached.fetch_add(1) < state_->cache_limit) {
+      find_free_list(cache->get(state_), size).buffers.push_back(ptr);
+      state_->bytes_cached += size;
+      return;
+    }
+    --state_->cached;
+    ::operator delete(ptr);
+  }
+
+  // The pool is owned by the context, which must outlive the streams
+  // using it as well as their operations
+  std::shared_ptr<buffer_allocator> share() override {
+    return std::shared_ptr<buffer_allocator>(std::shared_ptr<buffer_allocator>(), this);
+  }
+
+  // Keep track of the streams using this pool for reporting the
+  // memory used by their state.
+  void add_stream(std::size_t size) {
+    state_->state_bytes += size;
+  }
+
+  void remove_stream(std::size_t size) {
+    state_->state_bytes -= size;
+  }
+
+  void set_cache_limit(std::size_t limit) {
+    state_->cache_limit = limit;
+  }
+
+  std::size_t in_use() const {
+    return state_->in_use;
+  }
+
+  std::size_t cached() const {
+    return state_->cached;
+  }
+
+  wintls::memory_usage memory_usage() const {
+    wintls::memory_usage usage;
+    usage.state = state_->state_bytes;
+    usage.handshake = state_->bytes_in_use[static_cast<std::size_t>(buffer_kind::handshake)];
+    usage.decrypt = state_->bytes_in_use[static_cast<std::size_t>(buffer_kind::decrypt)];
+    usage.plaintext = state_->bytes_in_use[static_cast<std::size_t>(buffer_kind::plaintext)];
+    usage.encrypt = state_->bytes_in_use[static_cast<std::size_t>(buffer_kind::encrypt)];
+    usage.cached = state_->bytes_cached;
+    return usage;
+  }
+
+private:
+  void retire() {
+    state_->alive = false;
+    retired_pools().fetch_add(1, std::memory_order_release);
+    // Make sure nothing is left behind in the retiring thread. Other
+    // threads release their cached buffers, at most cache_limit in
+    // total, the next time they use a pool or when they exit.
+    if (thread_cache* cache = local_cache()) {
+      cache->purge();
+    }
+  }
+
+  std::shared_ptr<pool_state> state_;
+};
+
+// A buffer allocated from a buffer_allocator and returned to it when
+// released or destroyed.
+class pooled_buffer {
+public:
+  pooled_buffer(buffer_allocator& allocator, buffer_kind kind)
+    : allocator_(&allocator)
+    , kind_(kind) {
+  }
+
+  pooled_buffer(const pooled_buffer&) = delete;
+  pooled_buffer& operator=(const pooled_buffer&) = delete;
+
+  ~pooled_buffer() {
+    release();
+  }
+
+  char* data() {
+    return data_;
+  }
+
+  const char* data() const {
+    return data_;
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // Replace the buffer with one of the given size discarding any
+  // previous contents.
+  void allocate(std::size_t size) {
+    release();
+    data_ = static_cast<char*>(allocator_->allocate(size, kind_));
+    size_ = size;
+  }
+
+  // Replace the buffer with one of the given size keeping the first
+  // size_used bytes of the previous contents.
+  void grow(std::size_t size, std::size_t size_used) {
+    char* data = static_cast<char*>(allocator_->allocate(size, kind_));
+    if (size_used > 0) {
+      std::memcpy(data, data_, size_used);
+    }
+    release();
+    data_ = data;
+    size_ = size;
+  }
+
+  void release() {
+    if (data_ != nullptr) {
+      allocator_->deallocate(data_, size_, kind_);
+      data_ = nullptr;
+      size_ = 0;
+    }
+  }
+
+  // Return the buffer to the given allocator instead, which must be
+  // the one it was allocated from or a copy of it
+  void rebind(buffer_allocator& allocator) {
+    allocator_ = &allocator;
+  }
+
+  void swap(pooled_buffer& other) {
+    std::swap(allocator_, other.allocator_);
+    std::swap(kind_, other.kind_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+  }
+
+private:
+  buffer_allocator* allocator_;
+  buffer_kind kind_;
+  char* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_BUFFER_POOL_HPP
@@ -36,6 +36,22 @@
 #define WINTLS_UNREACHABLE_RETURN(x) __builtin_unreachable();
 #endif // !_MSC_VER
 
+#ifdef WINTLS_USE_STANDALONE_ASIO
+#if ASIO_VERSION >= 102800
+#define WINTLS_HAS_IMMEDIATE_EXECUTOR
+#endif // ASIO_VERSION >= 102800
+#else // WINTLS_USE_STANDALONE_ASIO
+#if BOOST_ASIO_VERSION >= 102800
+#define WINTLS_HAS_IMMEDIATE_EXECUTOR
+#endif // BOOST_ASIO_VERSION >= 102800
+#endif // !WINTLS_USE_STANDALONE_ASIO
+
+#if __cplusplus >= 201703L || (defined _MSVC_LANG && _MSVC_LANG >= 201703L)
+#if __has_include(<memory_resource>)
+#define WINTLS_HAS_MEMORY_RESOURCE
+#endif // __has_include(<memory_resource>)
+#endif // C++17
+
 namespace wintls {
 #ifdef WINTLS_USE_STANDALONE_ASIO
 namespace net = asio;
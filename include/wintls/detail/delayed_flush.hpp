@@ -0,0 +1,51 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_DELAYED_FLUSH_HPP
+#define WINTLS_DETAIL_DELAYED_FLUSH_HPP
+
+#include <wintls/detail/config.hpp>
+
+#ifdef WINTLS_USE_STANDALONE_ASIO
+#include <asio/steady_timer.hpp>
+#else // WINTLS_USE_STANDALONE_ASIO
+#include <boost/asio/steady_timer.hpp>
+#endif // !WINTLS_USE_STANDALONE_ASIO
+
+#include <chrono>
+#include <functional>
+
+namespace wintls {
+namespace detail {
+
+// The executor a delayed flush is run through, which is the one of
+// the write which scheduled it. It is only held by the handlers of
+// the timer and the write in progress.
+using flush_executor = net::steady_timer::executor_type;
+
+// Flushing of data corked by asynchronous writes after a delay, only
+// allocated when used. The timer and the write of the corked data
+// only keep a weak reference to the state and do nothing once the
+// stream owning it has been destroyed.
+struct delayed_flush {
+  explicit delayed_flush(const flush_executor& executor)
+    : timer(executor) {
+  }
+
+  net::steady_timer timer;
+  std::chrono::steady_clock::duration delay{};
+  bool scheduled = false;
+
+  // Start writing the corked data to the next layer. Set by the
+  // stream and bound again when the stream is moved.
+  std::function<void(const flush_executor&)> write;
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_DELAYED_FLUSH_HPP
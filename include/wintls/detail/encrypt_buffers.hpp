@@ -8,52 +8,237 @@
 #ifndef WINTLS_DETAIL_ENCRYPT_BUFFERS_HPP
 #define WINTLS_DETAIL_ENCRYPT_BUFFERS_HPP
 
+#include <wintls/detail/assert.hpp>
+#include <wintls/detail/buffer_pool.hpp>
 #include <wintls/detail/sspi_buffer_sequence.hpp>
 #include <wintls/detail/sspi_functions.hpp>
+#include <wintls/detail/sspi_sec_handle.hpp>
 #include <wintls/detail/config.hpp>
 
+#include <memory>
+#include <utility>
+
 namespace wintls {
 namespace detail {
 
+// The buffer holding the TLS records encrypted by a single write. As
+// many records as fit in the buffer are encrypted one after the
+// other, allowing them to be written to the next layer at once.
 class encrypt_buffers : public sspi_buffer_sequence<4> {
 public:
-  encrypt_buffers(ctxt_handle& ctxt_handle)
+  encrypt_buffers(ctxt_handle& ctxt_handle, buffer_allocator& allocator, std::size_t max_write_size)
     : sspi_buffer_sequence(std::array<sspi_buffer, 4> {
         SECBUFFER_STREAM_HEADER,
         SECBUFFER_DATA,
         SECBUFFER_STREAM_TRAILER,
         SECBUFFER_EMPTY
       })
-    , ctxt_handle_(ctxt_handle) {
+    , ctxt_handle_(ctxt_handle)
+    , data_(allocator, buffer_kind::encrypt)
+    , max_write_size_(max_write_size) {
   }
 
-  template <typename ConstBufferSequence> std::size_t operator()(const ConstBufferSequence& buffers, SECURITY_STATUS& sc) {
-    if (data_.empty()) {
-      sc = sspi_functions::QueryContextAttributesA(ctxt_handle_.get(), SECPKG_ATTR_STREAM_SIZES, &stream_sizes_);
-      if (sc != SEC_E_OK) {
-        return 0;
-      }
-      data_.resize(stream_sizes_.cbHeader + stream_sizes_.cbMaximumMessage + stream_sizes_.cbTrailer);
+  // Prepare the next record from the data following the given
+  // offset in the buffers, returning the number of bytes consumed or
+  // zero if there is no room left for another record.
+  template <typename ConstBufferSequence>
+  std::size_t operator()(const ConstBufferSequence& buffers, std::size_t offset, SECURITY_STATUS& sc) {
+    if (!query_stream_sizes(sc)) {
+      return 0;
+    }
+    const std::size_t size_left = net::buffer_size(buffers) - offset;
+    if (size_ == 0) {
+      allocate(size_left);
     }
 
-    const auto size_consumed = std::min(net::buffer_size(buffers), static_cast<size_t>(stream_sizes_.cbMaximumMessage));
+    const std::size_t overhead = stream_sizes_.cbHeader + stream_sizes_.cbTrailer;
+    const auto size_consumed = std::min(size_left, static_cast<size_t>(stream_sizes_.cbMaximumMessage));
+    if (size_ + overhead + size_consumed > data_.size()) {
+      return 0;
+    }
 
-    buffers_[0].pvBuffer = data_.data();
+    char* record = data_.data() + size_;
+    buffers_[0].pvBuffer = record;
     buffers_[0].cbBuffer = stream_sizes_.cbHeader;
 
-    net::buffer_copy(net::buffer(data_.data() + stream_sizes_.cbHeader, size_consumed), buffers);
-    buffers_[1].pvBuffer = data_.data() + stream_sizes_.cbHeader;
+    copy(buffers, offset, net::buffer(record + stream_sizes_.cbHeader, size_consumed));
+    buffers_[1].pvBuffer = record + stream_sizes_.cbHeader;
     buffers_[1].cbBuffer = static_cast<ULONG>(size_consumed);
 
-    buffers_[2].pvBuffer = data_.data() + stream_sizes_.cbHeader + size_consumed;
+    buffers_[2].pvBuffer = record + stream_sizes_.cbHeader + size_consumed;
     buffers_[2].cbBuffer = stream_sizes_.cbTrailer;
 
     return size_consumed;
   }
 
+  std::size_t max_message_size(SECURITY_STATUS& sc) {
+    if (!query_stream_sizes(sc)) {
+      return 0;
+    }
+    return stream_sizes_.cbMaximumMessage;
+  }
+
+  // The number of records room is made for by writes larger than a
+  // single record
+  std::size_t max_records(SECURITY_STATUS& sc) {
+    if (!query_stream_sizes(sc)) {
+      return 0;
+    }
+    const std::size_t max_message = stream_sizes_.cbMaximumMessage;
+    return std::max<std::size_t>((max_write_size_ + max_message - 1) / max_message, 1);
+  }
+
+  // Prepare a single record for data of up to the given size to be
+  // written directly into the buffer returned, between the space
+  // reserved for the header and the trailer. The record is placed
+  // after any records already encrypted.
+  net::mutable_buffer prepare(std::size_t size, SECURITY_STATUS& sc) {
+    if (!query_stream_sizes(sc)) {
+      return {};
+    }
+    const std::size_t max_message = stream_sizes_.cbMaximumMessage;
+    const std::size_t overhead = stream_sizes_.cbHeader + stream_sizes_.cbTrailer;
+    size = std::min(size, max_message);
+    if (size_ == 0) {
+      allocate(size);
+    } else if (size_ + overhead + size > data_.size()) {
+      data_.grow(size_ + overhead + max_message, size_);
+    }
+
+    char* record = data_.data() + size_;
+    buffers_[0].pvBuffer = record;
+    buffers_[0].cbBuffer = stream_sizes_.cbHeader;
+    buffers_[1].pvBuffer = record + stream_sizes_.cbHeader;
+    buffers_[1].cbBuffer = static_cast<ULONG>(size);
+    prepared_size_ = size;
+    return net::buffer(buffers_[1].pvBuffer, size);
+  }
+
+  // The size of the data the record prepared can hold, if any
+  std::size_t prepared_size() const {
+    return prepared_size_;
+  }
+
+  // Finish the record prepared with the amount of data actually
+  // written to it
+  std::size_t prepared(std::size_t size) {
+    WINTLS_ASSERT_MSG(size <= prepared_size_, "more data committed than prepared");
+    size = std::min(size, prepared_size_);
+    prepared_size_ = 0;
+    buffers_[1].cbBuffer = static_cast<ULONG>(size);
+    buffers_[2].pvBuffer = static_cast<char*>(buffers_[1].pvBuffer) + size;
+    buffers_[2].cbBuffer = stream_sizes_.cbTrailer;
+    return size;
+  }
+
+  // Keep the record just encrypted, placing the next one right after
+  // it. The trailer may end up shorter than reserved.
+  void commit() {
+    size_ += buffers_[0].cbBuffer + buffers_[1].cbBuffer + buffers_[2].cbBuffer;
+  }
+
+  // Start over with the next write
+  void clear() {
+    size_ = 0;
+    prepared_size_ = 0;
+  }
+
+  // Exchange the records encrypted and the buffer holding them with
+  // another set of buffers for the same security context
+  void swap(encrypt_buffers& other) {
+    data_.swap(other.data_);
+    std::swap(size_, other.size_);
+    std::swap(prepared_size_, other.prepared_size_);
+    std::swap(stream_sizes_, other.stream_sizes_);
+    std::swap(buffers_, other.buffers_);
+  }
+
+  std::size_t buffer_size() const {
+    return data_.size();
+  }
+
+  // Forget the stream sizes of the previous connection, keeping the
+  // buffer for reuse
+  void reset() {
+    stream_sizes_ = SecPkgContext_StreamSizes{0, 0, 0, 0, 0};
+    size_ = 0;
+    prepared_size_ = 0;
+  }
+
+  // Release the buffer holding the encrypted messages. It is
+  // allocated again when needed.
+  void release() {
+    data_.release();
+    size_ = 0;
+    prepared_size_ = 0;
+    for (auto& buffer : buffers_) {
+      buffer.pvBuffer = nullptr;
+      buffer.cbBuffer = 0;
+    }
+  }
+
+  // Keep the buffer until destroyed, freeing it using the given
+  // allocator instead of the one of the stream, which may be gone by
+  // then
+  void detach(std::shared_ptr<buffer_allocator> allocator) {
+    detached_allocator_ = std::move(allocator);
+    data_.rebind(*detached_allocator_);
+  }
+
+  // The encrypted records as a buffer which, unlike this class, is
+  // cheap to copy and doesn't own the underlying data.
+  net::const_buffer encrypted_data() const {
+    return net::buffer(data_.data(), size_);
+  }
+
 private:
+  bool query_stream_sizes(SECURITY_STATUS& sc) {
+    if (stream_sizes_.cbMaximumMessage == 0) {
+      sc = sspi_functions::QueryContextAttributesA(ctxt_handle_.get(), SECPKG_ATTR_STREAM_SIZES, &stream_sizes_);
+      if (sc != SEC_E_OK) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Room for a single record is enough for small writes. Larger
+  // writes get room for as many records as needed for the maximum
+  // write size, which is kept for the following writes.
+  void allocate(std::size_t size) {
+    const std::size_t max_message = stream_sizes_.cbMaximumMessage;
+    std::size_t records = 1;
+    if (size > max_message) {
+      SECURITY_STATUS sc = SEC_E_OK;
+      records = max_records(sc);
+    }
+    const std::size_t buffer_size = records * (stream_sizes_.cbHeader + max_message + stream_sizes_.cbTrailer);
+    if (data_.size() < buffer_size) {
+      data_.allocate(buffer_size);
+    }
+  }
+
+  template <typename ConstBufferSequence>
+  static void copy(const ConstBufferSequence& buffers, std::size_t offset, net::mutable_buffer destination) {
+    const auto end = net::buffer_sequence_end(buffers);
+    for (auto it = net::buffer_sequence_begin(buffers); it != end && destination.size() != 0; ++it) {
+      net::const_buffer buffer = *it;
+      if (offset >= buffer.size()) {
+        offset -= buffer.size();
+        continue;
+      }
+      buffer += offset;
+      offset = 0;
+      destination += net::buffer_copy(destination, buffer);
+    }
+  }
+
   ctxt_handle& ctxt_handle_;
-  std::vector<char> data_;
+  std::shared_ptr<buffer_allocator> detached_allocator_;
+  pooled_buffer data_;
+  std::size_t size_ = 0;
+  std::size_t prepared_size_ = 0;
+  std::size_t max_write_size_;
   SecPkgContext_StreamSizes stream_sizes_{0, 0, 0, 0, 0};
 };
 
@@ -0,0 +1,35 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_IMMEDIATE_COMPLETION_HPP
+#define WINTLS_DETAIL_IMMEDIATE_COMPLETION_HPP
+
+#include <wintls/detail/config.hpp>
+
+namespace wintls {
+namespace detail {
+
+// Resume a composed operation which completed without any I/O
+// through the immediate executor associated with the handler, if
+// any, allowing the handler to run without a round trip through the
+// scheduler. Otherwise the operation is resumed as if by net::post
+// to the executor associated with the handler, such as a strand.
+template <typename Self>
+void complete_immediately(Self& self) {
+#ifdef WINTLS_HAS_IMMEDIATE_EXECUTOR
+  auto e = net::get_associated_immediate_executor(self, self.get_executor());
+  net::dispatch(e, [self = std::move(self)]() mutable { self(); });
+#else // WINTLS_HAS_IMMEDIATE_EXECUTOR
+  auto e = self.get_executor();
+  net::post(e, [self = std::move(self)]() mutable { self(); });
+#endif // !WINTLS_HAS_IMMEDIATE_EXECUTOR
+}
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_IMMEDIATE_COMPLETION_HPP
@@ -0,0 +1,60 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_OPERATION_STATE_HPP
+#define WINTLS_DETAIL_OPERATION_STATE_HPP
+
+#include <wintls/detail/config.hpp>
+
+#include <memory>
+#include <utility>
+
+namespace wintls {
+namespace detail {
+
+// The allocator for state of type T holding a suspended composed
+// operation of type Self, which is the allocator associated with the
+// operation as asio uses for the state of its own operations.
+template <typename T, typename Self>
+using operation_state_allocator =
+    typename std::allocator_traits<typename net::associated_allocator<Self>::type>::template rebind_alloc<T>;
+
+// Allocate and construct state of type T from the suspended
+// operation, which is moved into it, followed by the other arguments
+template <typename T, typename Self, typename... Args>
+T* new_operation_state(Self& self, Args&&... args) {
+  using allocator_type = operation_state_allocator<T, Self>;
+  using traits_type = std::allocator_traits<allocator_type>;
+  allocator_type alloc(net::get_associated_allocator(self));
+  T* state = traits_type::allocate(alloc, 1);
+  try {
+    traits_type::construct(alloc, state, std::move(self), std::forward<Args>(args)...);
+  } catch (...) {
+    traits_type::deallocate(alloc, state, 1);
+    throw;
+  }
+  return state;
+}
+
+// Destroy and free state allocated by new_operation_state using the
+// allocator associated with the given operation, which is either the
+// one held by the state or the one just moved out of it. The state
+// must be freed before the operation is resumed, allowing the memory
+// to be reused by the operation.
+template <typename T, typename Self>
+void delete_operation_state(T* state, const Self& self) {
+  using allocator_type = operation_state_allocator<T, Self>;
+  using traits_type = std::allocator_traits<allocator_type>;
+  allocator_type alloc(net::get_associated_allocator(self));
+  traits_type::destroy(alloc, state);
+  traits_type::deallocate(alloc, state, 1);
+}
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_OPERATION_STATE_HPP
@@ -8,14 +8,17 @@
 #ifndef WINTLS_DETAIL_SSPI_DECRYPT_HPP
 #define WINTLS_DETAIL_SSPI_DECRYPT_HPP
 
+#include <wintls/detail/buffer_policy.hpp>
+#include <wintls/detail/buffer_pool.hpp>
 #include <wintls/detail/config.hpp>
 #include <wintls/detail/sspi_functions.hpp>
+#include <wintls/detail/sspi_handshake.hpp>
 #include <wintls/detail/decrypt_buffers.hpp>
-#include <wintls/detail/decrypted_data_buffer.hpp>
 #include <wintls/detail/sspi_sec_handle.hpp>
 
-#include <array>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 
 namespace wintls {
 namespace detail {
@@ -25,87 +28,663 @@ public:
   enum class state {
     data_needed,
     data_available,
+    data_to_write,
     error
   };
 
-  sspi_decrypt(ctxt_handle& ctxt_handle)
+  sspi_decrypt(ctxt_handle& ctxt_handle, sspi_handshake& handshake, buffer_allocator& allocator, const buffer_policy& policy)
     : size_decrypted(0)
-    , input_buffer(net::buffer(encrypted_data_))
     , ctxt_handle_(ctxt_handle)
-    , last_error_(SEC_E_OK) {
-    buffers_[0].pvBuffer = encrypted_data_.data();
+    , handshake_(handshake)
+    , policy_(policy)
+    , last_error_(SEC_E_OK)
+    , encrypted_data_(allocator, buffer_kind::decrypt)
+    , plaintext_(allocator, buffer_kind::plaintext) {
   }
 
   template <class MutableBufferSequence>
   state operator()(const MutableBufferSequence& output_buffers) {
-    if (!decrypted_data_.empty()) {
-      size_decrypted = decrypted_data_.get(output_buffers);
-      return state::data_available;
+    if (error_pending_) {
+      error_pending_ = false;
+      return state::error;
+    }
+
+    size_decrypted = 0;
+    record = net::const_buffer{};
+    if (direct_buffer_.size() != 0) {
+      return decrypt_direct();
+    }
+
+    const auto output_size = net::buffer_size(output_buffers);
+    if (decrypted_data_.size() != 0) {
+      deliver_plaintext(output_buffers);
+      if (!record_available(output_size)) {
+        return state::data_available;
+      }
+    }
+
+    if (!query_max_record_size()) {
+      return state::error;
+    }
+
+    if (post_handshake_in_progress()) {
+      const state result = continue_post_handshake();
+      if (result != state::data_available || post_handshake_in_progress() || size_decrypted != 0) {
+        return result;
+      }
     }
 
+    // When nothing is buffered and the caller passes a buffer large
+    // enough for any record, the ciphertext is read directly into
+    // that buffer and decrypted there.
     if (buffers_[0].cbBuffer == 0) {
-      input_buffer = net::buffer(encrypted_data_);
+      const auto begin = net::buffer_sequence_begin(output_buffers);
+      if (begin != net::buffer_sequence_end(output_buffers)) {
+        const net::mutable_buffer buffer(*begin);
+        if (buffer.size() >= max_record_size_) {
+          direct_buffer_ = buffer;
+          input_buffer = net::buffer(buffer.data(), read_size(0, header_size, buffer.size()));
+          return state::data_needed;
+        }
+      }
+    }
+
+    if (encrypted_data_.empty()) {
+      encrypted_data_.allocate(record_buffer_size());
+    }
+
+    return decrypt_records(output_buffers, output_size);
+  }
+
+  // Decrypt the next record in place, handing out a view of its
+  // plaintext as record instead of copying it anywhere. The view is
+  // valid until the next operation.
+  state read_record() {
+    if (error_pending_) {
+      error_pending_ = false;
+      return state::error;
+    }
+
+    size_decrypted = 0;
+    record = net::const_buffer{};
+    if (decrypted_data_.size() != 0) {
+      // What is left of a record partially read already
+      record = decrypted_data_;
+      decrypted_data_ = net::const_buffer{};
+      return state::data_available;
+    }
+
+    if (!query_max_record_size()) {
+      return state::error;
+    }
+    if (encrypted_data_.empty()) {
+      encrypted_data_.allocate(record_buffer_size());
+    }
+
+    if (post_handshake_in_progress()) {
+      const state result = continue_post_handshake();
+      if (result != state::data_available || post_handshake_in_progress()) {
+        return result;
+      }
+    }
+
+    // Skip any records without application data
+    do {
+      const std::size_t missing = record_bytes_missing();
+      if (missing != 0) {
+        return input_needed(missing);
+      }
+      const auto result = decrypt_in_place();
+      if (result != state::data_available) {
+        return result;
+      }
+    } while (decrypted_data_.size() == 0);
+
+    record = decrypted_data_;
+    decrypted_data_ = net::const_buffer{};
+    return state::data_available;
+  }
+
+  // The response to a post handshake message to write to the peer
+  net::const_buffer output_buffer() {
+    return handshake_.out_buffer();
+  }
+
+  void size_written(std::size_t size) {
+    handshake_.size_written(size);
+  }
+
+  void size_read(std::size_t size) {
+    if (read_ahead_max_ != 0) {
+      adapt_read_ahead(size, input_buffer.size());
+    }
+    buffers_[0].cbBuffer += static_cast<unsigned long>(size);
+  }
+
+  // Adapt the amount of data read ahead to the traffic seen, between
+  // the bounds given. Zero as the upper bound disables adapting.
+  void set_read_ahead_bounds(std::size_t min, std::size_t max) {
+    read_ahead_min_ = min;
+    read_ahead_max_ = max;
+    read_ahead_window_ = min;
+  }
+
+  // Mark the start and end of a read operation. The buffers are
+  // never released while an operation is in progress.
+  void begin_operation() {
+    operation_pending_ = true;
+  }
+
+  void end_operation() {
+    operation_pending_ = false;
+    if (direct_buffer_.size() != 0) {
+      // The operation failed before a complete record was received
+      leave_direct(0, buffers_[0].cbBuffer);
+    }
+    if (release_when_idle) {
+      release_buffers();
+    }
+  }
+
+  // Release the buffers unless they hold data not yet returned to
+  // the caller. They are allocated again when needed.
+  void release_buffers() {
+    if (operation_pending_ || record.size() != 0) {
+      return;
+    }
+    if (decrypted_data_.size() == 0) {
+      plaintext_.release();
+    }
+    const bool plaintext_in_record = decrypted_data_.size() != 0 && !policy_.copy_plaintext;
+    if (plaintext_in_record || buffers_[0].cbBuffer != 0) {
+      return;
+    }
+    encrypted_data_.release();
+    buffers_[0].pvBuffer = nullptr;
+    data_offset_ = 0;
+    input_buffer = net::mutable_buffer{};
+  }
+
+  std::size_t buffer_size() const {
+    return encrypted_data_.size();
+  }
+
+  std::size_t plaintext_buffer_size() const {
+    return plaintext_.size();
+  }
+
+  // The size of the buffer a read should be given for receiving the
+  // decrypted data pending or the next record in full. Without any
+  // data buffered this is the size of the largest record, allowing
+  // the record to be read directly into the buffer and decrypted
+  // there.
+  std::size_t read_size_hint() {
+    if (decrypted_data_.size() != 0) {
+      return decrypted_data_.size();
+    }
+    if (!query_max_record_size()) {
+      // Let the read itself report the error
+      return 1;
+    }
+    const std::size_t size_used = buffers_[0].cbBuffer;
+    if (size_used >= header_size) {
+      // Exact unless the trailer of the record is shorter than the
+      // maximum, as with padding, leaving a little plaintext over
+      const auto header = reinterpret_cast<const unsigned char*>(encrypted_data_.data() + data_offset_);
+      const std::size_t record_size = header_size + (static_cast<std::size_t>(header[3]) << 8 | header[4]);
+      return record_size > record_overhead_ ? record_size - record_overhead_ : 1;
+    }
+    return max_record_size_;
+  }
+
+  // Decrypted data not yet delivered to the application
+  std::size_t pending() const {
+    return decrypted_data_.size();
+  }
+
+  // Received data not yet decrypted, complete records as well as a
+  // partially received one
+  std::size_t buffered_ciphertext() const {
+    return direct_buffer_.size() != 0 ? 0 : buffers_[0].cbBuffer;
+  }
+
+  // Discard any data received so far, keeping the buffer for reuse
+  void reset() {
+    last_error_ = SEC_E_OK;
+    error_pending_ = false;
+    buffers_[0].cbBuffer = 0;
+    data_offset_ = 0;
+    decrypted_data_ = net::const_buffer{};
+    direct_buffer_ = net::mutable_buffer{};
+    input_buffer = net::mutable_buffer{};
+    record = net::const_buffer{};
+    size_decrypted = 0;
+    post_handshake_pending_ = false;
+    max_record_size_ = 0;
+    record_overhead_ = 0;
+    read_ahead_window_ = read_ahead_min_;
+    operation_pending_ = false;
+  }
+
+  std::size_t size_decrypted;
+  net::mutable_buffer input_buffer;
+  net::const_buffer record;
+  bool release_when_idle = false;
+  std::size_t read_ahead_limit = 0;
+
+  wintls::error_code last_error() const {
+    return error::make_error_code(last_error_);
+  }
+
+private:
+  static constexpr std::size_t header_size = 5;
+
+  // Decrypt the records read directly into the buffer of the caller,
+  // moving the plaintext of each to the start of the buffer. Only the
+  // header and trailer of each record need to be squeezed out, saving
+  // copying the data from a buffer of our own.
+  state decrypt_direct() {
+    const auto data = static_cast<char*>(direct_buffer_.data());
+    const std::size_t size = buffers_[0].cbBuffer;
+    std::size_t offset = 0;
+    last_error_ = SEC_E_OK;
+    while (record_bytes_missing(data + offset, size - offset) == 0) {
+      buffers_[0].pvBuffer = data + offset;
+      buffers_[0].cbBuffer = static_cast<unsigned long>(size - offset);
+      buffers_[0].BufferType = SECBUFFER_DATA;
+      buffers_[1].BufferType = SECBUFFER_EMPTY;
+      buffers_[2].BufferType = SECBUFFER_EMPTY;
+      buffers_[3].BufferType = SECBUFFER_EMPTY;
+
+      last_error_ = detail::sspi_functions::DecryptMessage(ctxt_handle_.get(), buffers_.desc(), 0, nullptr);
+      if (last_error_ != SEC_E_OK && last_error_ != SEC_I_RENEGOTIATE) {
+        break;
+      }
+      if (buffers_[1].BufferType == SECBUFFER_DATA) {
+        std::memmove(data + size_decrypted, buffers_[1].pvBuffer, buffers_[1].cbBuffer);
+        size_decrypted += buffers_[1].cbBuffer;
+      }
+      offset = size - (buffers_[3].BufferType == SECBUFFER_EXTRA ? buffers_[3].cbBuffer : 0);
+      if (last_error_ == SEC_I_RENEGOTIATE) {
+        // Handled in the buffer of our own like any other
+        const net::mutable_buffer output_buffer = direct_buffer_;
+        leave_direct(offset, size);
+        const state result = post_handshake();
+        if (result != state::data_available || size_decrypted != 0) {
+          return result;
+        }
+        return decrypt_records(output_buffer, output_buffer.size());
+      }
+    }
+
+    if (last_error_ == SEC_E_OK && size_decrypted == 0) {
+      // Keep reading until a record with any data has been received
+      const std::size_t size_used = size - offset;
+      std::memmove(data, data + offset, size_used);
+      const std::size_t missing = record_bytes_missing(data, size_used);
+      if (size_used + missing > direct_buffer_.size()) {
+        // A record larger than negotiated, continue in a buffer of our own
+        leave_direct(0, size_used);
+        return input_needed(missing);
+      }
+      buffers_[0].cbBuffer = static_cast<unsigned long>(size_used);
+      input_buffer = net::buffer(data + size_used, read_size(size_used, missing, direct_buffer_.size() - size_used));
       return state::data_needed;
     }
 
+    // Whatever follows the records decrypted is kept for the next read
+    leave_direct(offset, size);
+
+    if (last_error_ == SEC_E_INCOMPLETE_MESSAGE) {
+      // Only happens if SSPI disagrees with the record header
+      return size_decrypted != 0 ? state::data_available : input_needed(missing_hint());
+    }
+    if (last_error_ != SEC_E_OK) {
+      if (size_decrypted == 0) {
+        return state::error;
+      }
+      error_pending_ = true;
+    }
+    return state::data_available;
+  }
+
+  // Stop reading directly into the buffer of the caller, keeping the
+  // ciphertext between begin and end in the buffer of our own.
+  void leave_direct(std::size_t begin, std::size_t end) {
+    const auto data = static_cast<const char*>(direct_buffer_.data());
+    const std::size_t size = end - begin;
+    direct_buffer_ = net::mutable_buffer{};
+    data_offset_ = 0;
+    buffers_[0].cbBuffer = static_cast<unsigned long>(size);
+    if (size == 0) {
+      return;
+    }
+    if (encrypted_data_.size() < size) {
+      encrypted_data_.allocate(std::max(record_buffer_size(), size));
+    }
+    std::memcpy(encrypted_data_.data(), data + begin, size);
+  }
+
+  bool query_max_record_size() {
+    if (max_record_size_ == 0) {
+      SecPkgContext_StreamSizes stream_sizes{0, 0, 0, 0, 0};
+      last_error_ = detail::sspi_functions::QueryContextAttributesA(ctxt_handle_.get(), SECPKG_ATTR_STREAM_SIZES, &stream_sizes);
+      if (last_error_ != SEC_E_OK) {
+        return false;
+      }
+      max_record_size_ = stream_sizes.cbHeader + stream_sizes.cbMaximumMessage + stream_sizes.cbTrailer;
+      record_overhead_ = stream_sizes.cbHeader + stream_sizes.cbTrailer;
+    }
+    return true;
+  }
+
+  std::size_t record_buffer_size() const {
+    return policy_.record_buffer_size != 0 ? policy_.record_buffer_size : max_record_size_;
+  }
+
+  std::size_t missing_hint() const {
+    std::size_t missing = 1;
+    for (const auto& buffer : buffers_) {
+      if (buffer.BufferType == SECBUFFER_MISSING && buffer.cbBuffer != 0) {
+        missing = buffer.cbBuffer;
+      }
+    }
+    return missing;
+  }
+
+  // Keep decrypting records already received for as long as there
+  // is room left in the output buffers, saving the caller from
+  // having to come back for each of them.
+  template <class MutableBufferSequence>
+  state decrypt_records(const MutableBufferSequence& output_buffers, std::size_t output_size) {
+    for (;;) {
+      // Don't bother SSPI before a complete record has been received
+      const std::size_t missing = record_bytes_missing();
+      if (missing != 0) {
+        return size_decrypted != 0 ? state::data_available : input_needed(missing);
+      }
+      const state result = decrypt_record(output_buffers);
+      if (result != state::data_available || error_pending_ || post_handshake_in_progress() ||
+          decrypted_data_.size() != 0 || size_decrypted >= output_size) {
+        return result;
+      }
+    }
+  }
+
+  bool post_handshake_in_progress() {
+    return post_handshake_pending_ || handshake_.out_buffer().size() != 0;
+  }
+
+  // Write the response to a post handshake message or keep feeding
+  // SSPI until done with a message spanning several records.
+  state continue_post_handshake() {
+    if (handshake_.out_buffer().size() != 0) {
+      return size_decrypted != 0 ? state::data_available : state::data_to_write;
+    }
+    return post_handshake();
+  }
+
+  // Feed a post handshake message, like a TLS 1.3 session ticket or
+  // key update, following the record just decrypted back to SSPI,
+  // which is how SSPI wants these to be handled. Any data decrypted
+  // already is returned first, before writing a response or reading
+  // any more.
+  state post_handshake() {
+    const bool data_decrypted = size_decrypted != 0 || decrypted_data_.size() != 0;
+    const std::size_t size = buffers_[0].cbBuffer;
+    post_handshake_pending_ = true;
+    if (size == 0) {
+      return data_decrypted ? state::data_available : input_needed(1);
+    }
+
+    std::size_t extra_size = 0;
+    std::size_t missing = 0;
+    last_error_ = handshake_.post_handshake(net::buffer(encrypted_data_.data() + data_offset_, size), extra_size, missing);
+    if (last_error_ != SEC_E_OK && last_error_ != SEC_I_CONTINUE_NEEDED && last_error_ != SEC_E_INCOMPLETE_MESSAGE) {
+      post_handshake_pending_ = false;
+      if (!data_decrypted) {
+        return state::error;
+      }
+      error_pending_ = true;
+      return state::data_available;
+    }
+
+    post_handshake_pending_ = last_error_ != SEC_E_OK;
+    data_offset_ = extra_size != 0 ? data_offset_ + size - extra_size : 0;
+    buffers_[0].cbBuffer = static_cast<unsigned long>(extra_size);
+    last_error_ = SEC_E_OK;
+    if (data_decrypted) {
+      return state::data_available;
+    }
+    if (handshake_.out_buffer().size() != 0) {
+      return state::data_to_write;
+    }
+    if (post_handshake_pending_) {
+      return input_needed(std::max<std::size_t>(missing, 1));
+    }
+    return state::data_available;
+  }
+
+  template <class MutableBufferSequence>
+  state decrypt_record(const MutableBufferSequence& output_buffers) {
+    const auto result = decrypt_in_place();
+    // Whatever doesn't fit in the output buffers is served from the
+    // record by the following reads, unless the policy says to copy
+    // the plaintext out of the way.
+    if (decrypted_data_.size() != 0) {
+      deliver_plaintext(output_buffers);
+      if (decrypted_data_.size() != 0 && policy_.copy_plaintext) {
+        copy_plaintext();
+      }
+    }
+    return result;
+  }
+
+  // Decrypt the record at the start of the ciphertext buffered,
+  // leaving its plaintext in place as the decrypted data.
+  state decrypt_in_place() {
+    buffers_[0].pvBuffer = encrypted_data_.data() + data_offset_;
     buffers_[0].BufferType = SECBUFFER_DATA;
     buffers_[1].BufferType = SECBUFFER_EMPTY;
     buffers_[2].BufferType = SECBUFFER_EMPTY;
     buffers_[3].BufferType = SECBUFFER_EMPTY;
 
-    input_buffer = net::buffer(encrypted_data_) + buffers_[0].cbBuffer;
     const auto size = buffers_[0].cbBuffer;
     last_error_ = detail::sspi_functions::DecryptMessage(ctxt_handle_.get(), buffers_.desc(), 0, nullptr);
 
     if (last_error_ == SEC_E_INCOMPLETE_MESSAGE) {
+      // Only happens if SSPI disagrees with the record header
       buffers_[0].cbBuffer = size;
-      return state::data_needed;
+      if (size_decrypted != 0) {
+        return state::data_available;
+      }
+      return input_needed(missing_hint());
     }
 
-    if (last_error_ != SEC_E_OK) {
+    if (last_error_ != SEC_E_OK && last_error_ != SEC_I_RENEGOTIATE) {
+      // Return the data decrypted so far first
+      if (size_decrypted != 0) {
+        error_pending_ = true;
+        return state::data_available;
+      }
       return state::error;
     }
 
     if (buffers_[1].BufferType == SECBUFFER_DATA) {
-      const auto data_ptr = reinterpret_cast<const char*>(buffers_[1].pvBuffer);
-      const auto data_size = buffers_[1].cbBuffer;
-      size_decrypted = net::buffer_copy(output_buffers, net::buffer(data_ptr, data_size));
-      if (size_decrypted < data_size) {
-        decrypted_data_.fill(net::buffer(data_ptr + size_decrypted, data_size - size_decrypted));
+      decrypted_data_ = net::buffer(buffers_[1].pvBuffer, buffers_[1].cbBuffer);
+    }
+
+    // Any ciphertext following the record is left where it is. The
+    // buffer is only compacted when running out of room at the end.
+    const unsigned long extra_size = buffers_[3].BufferType == SECBUFFER_EXTRA ? buffers_[3].cbBuffer : 0;
+    data_offset_ = extra_size != 0 ? data_offset_ + size - extra_size : 0;
+    buffers_[0].cbBuffer = extra_size;
+
+    if (last_error_ == SEC_I_RENEGOTIATE) {
+      return post_handshake();
+    }
+    return state::data_available;
+  }
+
+  // Copy as much of the decrypted data as fits to the output buffers
+  // following what has already been copied there.
+  template <class MutableBufferSequence>
+  void deliver_plaintext(const MutableBufferSequence& output_buffers) {
+    std::size_t offset = size_decrypted;
+    const auto end = net::buffer_sequence_end(output_buffers);
+    for (auto it = net::buffer_sequence_begin(output_buffers); it != end && decrypted_data_.size() != 0; ++it) {
+      net::mutable_buffer buffer(*it);
+      if (offset >= buffer.size()) {
+        offset -= buffer.size();
+        continue;
       }
+      buffer += offset;
+      offset = 0;
+      const auto size = net::buffer_copy(buffer, decrypted_data_);
+      decrypted_data_ += size;
+      size_decrypted += size;
     }
+  }
+
+  // Whether another complete record can be decrypted into the space
+  // left in the output buffers.
+  bool record_available(std::size_t output_size) const {
+    return !error_pending_ && decrypted_data_.size() == 0 && size_decrypted < output_size && buffers_[0].cbBuffer != 0 &&
+           record_bytes_missing() == 0;
+  }
 
-    if (buffers_[3].BufferType == SECBUFFER_EXTRA) {
-      const auto extra_size = buffers_[3].cbBuffer;
-      std::memmove(encrypted_data_.data(), buffers_[3].pvBuffer, extra_size);
-      buffers_[0].cbBuffer = extra_size;
-    } else {
-      buffers_[0].cbBuffer = 0;
+  // Move the ciphertext not yet decrypted to the start of the buffer
+  void compact() {
+    std::memmove(encrypted_data_.data(), encrypted_data_.data() + data_offset_, buffers_[0].cbBuffer);
+    data_offset_ = 0;
+  }
+
+  // Copy the plaintext left over from the last record to a buffer of
+  // its own, making room for the following records.
+  void copy_plaintext() {
+    const auto size = decrypted_data_.size();
+    if (plaintext_.size() < size) {
+      plaintext_.allocate(size);
     }
+    std::memcpy(plaintext_.data(), decrypted_data_.data(), size);
+    decrypted_data_ = net::buffer(plaintext_.data(), size);
+  }
 
-    return state::data_available;
+  // Make room for reading the given number of bytes still missing
+  // from the current record, growing the buffer if needed. The
+  // buffer is never grown beyond the maximum size given by the policy
+  // in case a peer sends records larger than the negotiated stream
+  // sizes suggest.
+  state input_needed(std::size_t missing) {
+    if (encrypted_data_.empty()) {
+      encrypted_data_.allocate(record_buffer_size());
+    }
+    const std::size_t size_used = buffers_[0].cbBuffer;
+    const std::size_t size_needed = size_used + missing;
+    if (size_needed > encrypted_data_.size()) {
+      const std::size_t max_size = policy_.max_record_buffer_size;
+      if (size_needed > max_size) {
+        last_error_ = SEC_E_BUFFER_TOO_SMALL;
+        return state::error;
+      }
+      if (data_offset_ != 0) {
+        compact();
+      }
+      const std::size_t new_size = std::max(encrypted_data_.size() * 2, size_needed);
+      encrypted_data_.grow(std::min(new_size, max_size), size_used);
+    }
+    update_input_buffer();
+    return state::data_needed;
   }
 
-  void size_read(std::size_t size) {
-    buffers_[0].cbBuffer += static_cast<unsigned long>(size);
-    input_buffer = net::buffer(encrypted_data_) + buffers_[0].cbBuffer;
+  // The number of bytes still needed for completing the TLS record
+  // at the start of the buffer according to its header.
+  std::size_t record_bytes_missing() const {
+    return record_bytes_missing(encrypted_data_.data() + data_offset_, buffers_[0].cbBuffer);
   }
 
-  std::size_t size_decrypted;
-  net::mutable_buffer input_buffer;
+  static std::size_t record_bytes_missing(const char* data, std::size_t size) {
+    if (size < header_size) {
+      return header_size - size;
+    }
+    const auto header = reinterpret_cast<const unsigned char*>(data);
+    const std::size_t record_size = header_size + (static_cast<std::size_t>(header[3]) << 8 | header[4]);
+    return record_size > size ? record_size - size : 0;
+  }
 
-  wintls::error_code last_error() const {
-    return error::make_error_code(last_error_);
+  // How much to read into the space available when size_used bytes
+  // of ciphertext are already buffered. With a read ahead limit, no
+  // more is read than needed for completing the current record once
+  // the limit has been reached.
+  std::size_t read_size(std::size_t size_used, std::size_t missing, std::size_t available) const {
+    const std::size_t limit = read_ahead();
+    if (limit != 0) {
+      const std::size_t allowed = limit > size_used ? limit - size_used : 0;
+      const std::size_t wanted = std::max(allowed, missing);
+      if (wanted != 0) {
+        return std::min(available, wanted);
+      }
+    }
+    return available;
   }
 
-private:
-  static constexpr std::size_t buffer_size = 0x10000;
+  std::size_t read_ahead() const {
+    if (read_ahead_max_ == 0) {
+      return read_ahead_limit;
+    }
+    return read_ahead_limit != 0 ? std::min(read_ahead_limit, read_ahead_window_) : read_ahead_window_;
+  }
+
+  // Grow the read ahead window while reads fill all the space offered,
+  // as when the peer is streaming bulk data, and shrink it again when
+  // reads return much less, as with interactive traffic.
+  void adapt_read_ahead(std::size_t size, std::size_t offered) {
+    if (size == offered) {
+      read_ahead_window_ = std::min(read_ahead_window_ * 2, read_ahead_max_);
+    } else if (size < offered / 2) {
+      read_ahead_window_ = std::max(read_ahead_window_ / 2, read_ahead_min_);
+    }
+  }
+
+  // Point the input buffer at the free part of the buffer following
+  // the ciphertext not yet decrypted, compacting the buffer first if
+  // the rest of the current record doesn't fit. With an adaptive read
+  // ahead window larger than the buffer, the buffer is grown to match.
+  void update_input_buffer() {
+    const std::size_t size_used = buffers_[0].cbBuffer;
+    const std::size_t missing = record_bytes_missing();
+    const std::size_t wanted = std::min(read_ahead(), policy_.max_record_buffer_size);
+    if (read_ahead_max_ != 0 && wanted > encrypted_data_.size()) {
+      if (data_offset_ != 0) {
+        compact();
+      }
+      encrypted_data_.grow(wanted, size_used);
+    }
+    if (data_offset_ != 0 && encrypted_data_.size() - data_offset_ - size_used < std::max<std::size_t>(missing, 1)) {
+      compact();
+    }
+    const std::size_t data_end = data_offset_ + size_used;
+    input_buffer = net::buffer(encrypted_data_.data() + data_end, read_size(size_used, missing, encrypted_data_.size() - data_end));
+  }
 
   ctxt_handle& ctxt_handle_;
+  sspi_handshake& handshake_;
+  const buffer_policy policy_;
   SECURITY_STATUS last_error_;
   decrypt_buffers buffers_;
-  std::array<char, buffer_size> encrypted_data_;
-  decrypted_data_buffer<buffer_size> decrypted_data_;
+  pooled_buffer encrypted_data_;
+  pooled_buffer plaintext_;
+  std::size_t max_record_size_ = 0;
+  std::size_t record_overhead_ = 0;
+  std::size_t data_offset_ = 0;
+  std::size_t read_ahead_min_ = 0;
+  std::size_t read_ahead_max_ = 0;
+  std::size_t read_ahead_window_ = 0;
+  bool operation_pending_ = false;
+  bool error_pending_ = false;
+  bool post_handshake_pending_ = false;
+  net::const_buffer decrypted_data_;
+  net::mutable_buffer direct_buffer_;
 };
 
 } // namespace detail
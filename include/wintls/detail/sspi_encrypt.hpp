@@ -8,43 +8,526 @@
 #ifndef WINTLS_DETAIL_SSPI_ENCRYPT_HPP
 #define WINTLS_DETAIL_SSPI_ENCRYPT_HPP
 
+#include <wintls/detail/buffer_policy.hpp>
+#include <wintls/detail/buffer_pool.hpp>
 #include <wintls/detail/config.hpp>
+#include <wintls/detail/delayed_flush.hpp>
 #include <wintls/detail/encrypt_buffers.hpp>
+#include <wintls/detail/operation_state.hpp>
 #include <wintls/detail/sspi_sec_handle.hpp>
+#include <wintls/detail/write_queue.hpp>
+
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
 
 namespace wintls {
 namespace detail {
 
+// Completion condition for writing all of the encrypted records like
+// net::transfer_all, but without limiting each write to the next layer
+// to 64 KiB
+struct transfer_all_records {
+  std::size_t operator()(const wintls::error_code& ec, std::size_t) const {
+    return ec ? 0 : (std::numeric_limits<std::size_t>::max)();
+  }
+};
+
 class sspi_encrypt {
 public:
-  sspi_encrypt(ctxt_handle& ctxt_handle)
-    : buffers(ctxt_handle)
-    , ctxt_handle_(ctxt_handle) {
+  sspi_encrypt(ctxt_handle& ctxt_handle, buffer_allocator& allocator, const buffer_policy& policy)
+    : buffers(ctxt_handle, allocator, policy.max_write_size)
+    , ctxt_handle_(ctxt_handle)
+    , allocator_(allocator)
+    , max_write_size_(policy.max_write_size)
+    , pipeline_writes_(policy.pipeline_writes)
+    , corked_data_(allocator, buffer_kind::encrypt) {
   }
 
+  sspi_encrypt(const sspi_encrypt&) = delete;
+  sspi_encrypt& operator=(const sspi_encrypt&) = delete;
+
+  ~sspi_encrypt() {
+    abandon_write_behind();
+    destroy_waiters();
+  }
+
+  // Encrypt the data written unless corked, in which case it is
+  // collected into a single record until the record is full. Sets
+  // ready if there are encrypted records to be written.
   template <typename ConstBufferSequence>
-  std::size_t operator()(const ConstBufferSequence& buf, wintls::error_code& ec) {
-    SECURITY_STATUS sc = SEC_E_OK;
+  std::size_t write(const ConstBufferSequence& buf, bool& ready, wintls::error_code& ec) {
+    ready = false;
+    if (flush_error) {
+      ec = flush_error;
+      flush_error = {};
+      return 0;
+    }
+    if (corked_size_ == 0 && !corked) {
+      const std::size_t size = (*this)(buf, ec);
+      ready = !ec;
+      return size;
+    }
 
-    std::size_t size_encrypted = buffers(buf, sc);
+    SECURITY_STATUS sc = SEC_E_OK;
+    const std::size_t max_message = buffers.max_message_size(sc);
     if (sc != SEC_E_OK) {
       ec = error::make_error_code(sc);
       return 0;
     }
+    if (corked_size_ == 0 && net::buffer_size(buf) >= max_message) {
+      // Nothing to gain from collecting data filling whole records
+      const std::size_t size = (*this)(buf, ec);
+      ready = !ec;
+      return size;
+    }
+
+    if (corked_data_.size() < max_message) {
+      corked_data_.grow(max_message, corked_size_);
+    }
+    const std::size_t size = net::buffer_copy(net::buffer(corked_data_.data() + corked_size_, max_message - corked_size_), buf);
+    corked_size_ += size;
+    if (corked_size_ == max_message || !corked) {
+      ready = flush(ec);
+      if (ec) {
+        return 0;
+      }
+    }
+    return size;
+  }
+
+  // Encrypt any corked data, returning whether there is a record to
+  // be written
+  bool flush(wintls::error_code& ec) {
+    if (flush_error) {
+      ec = flush_error;
+      flush_error = {};
+      return false;
+    }
+    if (corked_size_ == 0) {
+      return false;
+    }
+    (*this)(net::buffer(corked_data_.data(), corked_size_), ec);
+    corked_size_ = 0;
+    return !ec;
+  }
+
+  std::size_t corked_size() const {
+    return corked_size_;
+  }
+
+  // Suspend an asynchronous operation until a delayed flush of
+  // corked data or a write behind in progress has completed. Several
+  // operations may wait at once, for example a write along with a
+  // flush or a shutdown, and are all resumed in the order suspended.
+  template <typename Self>
+  void wait_for_flush(Self& self) {
+    waiter* suspended = new_operation_state<waiter_impl<Self>>(self);
+    if (waiters_tail_ != nullptr) {
+      waiters_tail_->next_ = suspended;
+    } else {
+      waiters_head_ = suspended;
+    }
+    waiters_tail_ = suspended;
+  }
+
+  // Flush corked data after the given delay, or only when the record
+  // is full or explicitly flushed if zero
+  void set_flush_delay(std::chrono::steady_clock::duration delay, const flush_executor& executor) {
+    if (!delayed_flush_) {
+      if (delay == std::chrono::steady_clock::duration::zero()) {
+        return;
+      }
+      delayed_flush_ = allocator_.make_shared_state<delayed_flush>(executor);
+    }
+    delayed_flush_->delay = delay;
+  }
+
+  // Set how the stream writes corked data once the delay has expired
+  void set_flush_write(std::function<void(const flush_executor&)> write) {
+    if (delayed_flush_) {
+      delayed_flush_->write = std::move(write);
+    }
+  }
+
+  // Start the delay after which data corked by an asynchronous write
+  // is flushed, if not already started. The flush is run through the
+  // executor of the write.
+  void schedule_flush(const flush_executor& executor) {
+    if (flush_due()) {
+      start_flush_timer(executor);
+    }
+  }
+
+  // Encrypt the corked data and start writing it to the next layer
+  // when the delay has expired. The records are written behind, like
+  // the ones of a pipelined write, so they are kept until written
+  // even if the stream is destroyed or reset in the meantime.
+  template <typename NextLayer>
+  void write_corked(NextLayer& next_layer, const flush_executor& executor) {
+    wintls::error_code ec;
+    begin_operation();
+    if (flush(ec)) {
+      write_behind(next_layer, executor);
+    }
+    end_operation();
+    if (ec) {
+      flush_error = ec;
+    }
+  }
+
+  // Whether asynchronous writes are pipelined, which they are unless
+  // anything is corked
+  bool pipelined() const {
+    return pipeline_writes_ && !corked && corked_size_ == 0;
+  }
+
+  // Whether the write in progress in the background, if any, is a
+  // write behind, which leaves the buffers free for encrypting the
+  // data of the following write. Delayed flushes are written behind
+  // as well.
+  bool writing_behind() const {
+    return writing_behind_;
+  }
+
+  // Start writing the records encrypted by a pipelined write or a
+  // delayed flush to the next layer from a second buffer, exchanging
+  // it with the buffers which the following write encrypts its data
+  // into while this write is in progress. The write is completed
+  // through the given executor and is abandoned if the stream is
+  // destroyed or reset in the meantime, but the records are kept
+  // until the write is done either way. Destroying the next layer
+  // along with the stream cancels the write. Any error is reported by
+  // the following write or flush.
+  template <typename NextLayer, typename Executor>
+  void write_behind(NextLayer& next_layer, const Executor& executor) {
+    if (!behind_) {
+      behind_ = allocator_.make_shared_state<encrypt_buffers>(ctxt_handle_, allocator_, max_write_size_);
+    }
+    if (!alive_) {
+      alive_ = allocator_.make_shared_state<bool>(true);
+    }
+    buffers.swap(*behind_);
+    buffers.clear();
+    flush_pending = true;
+    writing_behind_ = true;
+    std::weak_ptr<bool> alive = alive_;
+    const std::shared_ptr<encrypt_buffers> behind = behind_;
+    net::async_write(next_layer, behind->encrypted_data(), transfer_all_records{}, net::bind_executor(executor, [this, alive, behind, executor](const wintls::error_code& error, std::size_t) {
+      if (alive.expired()) {
+        return;
+      }
+      flush_pending = false;
+      writing_behind_ = false;
+      if (error) {
+        flush_error = error;
+      }
+      if (release_when_idle) {
+        behind->release();
+      }
+      resume_waiters();
+      // Data corked in the meantime is flushed after the delay, even
+      // if the operations resumed leave it corked
+      if (!error) {
+        schedule_flush(executor);
+      }
+    }));
+  }
+
+  // Encrypt as many records as fit in the buffer, returning the
+  // number of bytes consumed from the given buffers
+  template <typename ConstBufferSequence>
+  std::size_t operator()(const ConstBufferSequence& buf, wintls::error_code& ec) {
+    return (*this)(buf, 0, ec);
+  }
+
+  // Encrypt as many records as fit in the buffer from the data
+  // following the given offset in the buffers
+  template <typename ConstBufferSequence>
+  std::size_t operator()(const ConstBufferSequence& buf, std::size_t offset, wintls::error_code& ec) {
+    buffers.clear();
+    return encrypt_records(buf, offset, ec);
+  }
+
+  // Get a buffer for up to the given amount of data to be encrypted
+  // in place by encrypt_prepared. Any corked data is encrypted into a
+  // record preceding it, so it is written first.
+  net::mutable_buffer prepare(std::size_t size, wintls::error_code& ec) {
+    buffers.clear();
+    flush(ec);
+    if (ec) {
+      return {};
+    }
+    SECURITY_STATUS sc = SEC_E_OK;
+    const auto buffer = buffers.prepare(size, sc);
+    if (sc != SEC_E_OK) {
+      ec = error::make_error_code(sc);
+      return {};
+    }
+    prepared_ = true;
+    return buffer;
+  }
+
+  // Whether a buffer has been prepared and not yet encrypted
+  bool prepared() const {
+    return prepared_;
+  }
 
-    sc = detail::sspi_functions::EncryptMessage(ctxt_handle_.get(), 0, buffers.desc(), 0);
+  // Encrypt the given amount of data written into the prepared
+  // buffer, which must not exceed the size of the buffer
+  std::size_t encrypt_prepared(std::size_t size, wintls::error_code& ec) {
+    prepared_ = false;
+    if (size > buffers.prepared_size()) {
+      ec = net::error::invalid_argument;
+      return 0;
+    }
+    size = buffers.prepared(size);
+    SECURITY_STATUS sc = detail::sspi_functions::EncryptMessage(ctxt_handle_.get(), 0, buffers.desc(), 0);
     if (sc != SEC_E_OK) {
       ec = error::make_error_code(sc);
       return 0;
     }
+    buffers.commit();
+    return size;
+  }
 
-    return size_encrypted;
+  // Mark the start and end of a write operation. The buffers are
+  // never released while an operation is in progress.
+  void begin_operation() {
+    operation_pending_ = true;
+  }
+
+  // Synchronous operations can't wait for a delayed flush of corked
+  // data writing from the buffers to complete
+  bool begin_sync_operation(wintls::error_code& ec) {
+    if (flush_pending) {
+      ec = net::error::in_progress;
+      return false;
+    }
+    begin_operation();
+    return true;
+  }
+
+  void end_operation() {
+    operation_pending_ = false;
+    if (release_when_idle) {
+      release_buffers();
+    }
+  }
+
+  bool operation_pending() const {
+    return operation_pending_;
+  }
+
+  void release_buffers() {
+    if (!operation_pending_) {
+      buffers.release();
+      if (corked_size_ == 0) {
+        corked_data_.release();
+      }
+    }
+    if (behind_ && !writing_behind_) {
+      behind_->release();
+    }
+  }
+
+  std::size_t buffer_size() const {
+    return buffers.buffer_size() + corked_data_.size() + (behind_ ? behind_->buffer_size() : 0);
+  }
+
+  // Discard the state of the connection. A delayed flush or a write
+  // behind still pending is abandoned, as when the stream is
+  // destroyed, by dropping the state their handlers refer to.
+  void reset() {
+    buffers.reset();
+    abandon_write_behind();
+    if (behind_) {
+      behind_->reset();
+    }
+    delayed_flush_.reset();
+    destroy_waiters();
+    operation_pending_ = false;
+    prepared_ = false;
+    corked = false;
+    corked_size_ = 0;
+    flush_pending = false;
+    writing_behind_ = false;
+    flush_error = {};
   }
 
   encrypt_buffers buffers;
+  bool release_when_idle = false;
+
+  // Cork mode and the state of flushing corked data after a delay
+  bool corked = false;
+  bool flush_pending = false;
+  wintls::error_code flush_error;
+
+  // Asynchronous writes waiting for the one in progress when writes
+  // are queued
+  write_queue queue;
 
 private:
+  // An asynchronous operation suspended until a delayed flush or a
+  // write behind has completed, allocated using the allocator
+  // associated with the operation. The operations waiting are linked
+  // through the waiters themselves.
+  class waiter {
+  public:
+    virtual void resume() = 0;
+    virtual void destroy() = 0;
+
+  protected:
+    ~waiter() = default;
+
+  private:
+    friend class sspi_encrypt;
+    waiter* next_ = nullptr;
+  };
+
+  template <typename Self>
+  class waiter_impl : public waiter {
+  public:
+    explicit waiter_impl(Self&& self)
+      : self_(std::move(self)) {
+    }
+
+    // Resumed through the executor of the operation, which may differ
+    // from the one the flush or write completed on
+    void resume() override {
+      Self self = std::move(self_);
+      delete_operation_state(this, self);
+      auto e = self.get_executor();
+      net::post(e, [self = std::move(self)]() mutable { self(); });
+    }
+
+    void destroy() override {
+      delete_operation_state(this, self_);
+    }
+
+  private:
+    Self self_;
+  };
+
+  // Resume all of the operations waiting for the write in progress,
+  // returning whether there were any. The list is taken before
+  // resuming, as the resumed operations may wait again.
+  bool resume_waiters() {
+    waiter* resumed = waiters_head_;
+    if (resumed == nullptr) {
+      return false;
+    }
+    waiters_head_ = nullptr;
+    waiters_tail_ = nullptr;
+    while (resumed != nullptr) {
+      waiter* next = resumed->next_;
+      resumed->resume();
+      resumed = next;
+    }
+    return true;
+  }
+
+  // Leave the records of a write behind in progress to the write,
+  // which frees them using a copy of the allocator once done, and
+  // make its handler do nothing
+  void abandon_write_behind() {
+    if (writing_behind_) {
+      behind_->detach(allocator_.share());
+      behind_.reset();
+      writing_behind_ = false;
+    }
+    alive_.reset();
+  }
+
+  // Free the operations waiting without resuming them
+  void destroy_waiters() {
+    while (waiters_head_ != nullptr) {
+      waiter* next = waiters_head_->next_;
+      waiters_head_->destroy();
+      waiters_head_ = next;
+    }
+    waiters_tail_ = nullptr;
+  }
+
+  // Encrypt records following the ones already in the buffer for the
+  // data following the given offset
+  template <typename ConstBufferSequence>
+  std::size_t encrypt_records(const ConstBufferSequence& buf, std::size_t offset, wintls::error_code& ec) {
+    const std::size_t size = net::buffer_size(buf) - offset;
+    std::size_t size_encrypted = 0;
+    do {
+      SECURITY_STATUS sc = SEC_E_OK;
+      const std::size_t size_consumed = buffers(buf, offset + size_encrypted, sc);
+      if (sc != SEC_E_OK) {
+        ec = error::make_error_code(sc);
+        return 0;
+      }
+      if (size_consumed == 0 && (size_encrypted != 0 || size != 0)) {
+        break;
+      }
+
+      sc = detail::sspi_functions::EncryptMessage(ctxt_handle_.get(), 0, buffers.desc(), 0);
+      if (sc != SEC_E_OK) {
+        ec = error::make_error_code(sc);
+        return 0;
+      }
+      buffers.commit();
+      size_encrypted += size_consumed;
+    } while (size_encrypted < size);
+
+    return size_encrypted;
+  }
+
+  bool flush_due() const {
+    return delayed_flush_ && delayed_flush_->delay != std::chrono::steady_clock::duration::zero() &&
+           !delayed_flush_->scheduled && !flush_pending && corked_size_ != 0;
+  }
+
+  void start_flush_timer(const flush_executor& executor) {
+    delayed_flush_->scheduled = true;
+    delayed_flush_->timer.expires_after(delayed_flush_->delay);
+    std::weak_ptr<delayed_flush> state = delayed_flush_;
+    delayed_flush_->timer.async_wait(net::bind_executor(executor, [this, state, executor](const wintls::error_code& ec) {
+      const auto flush = state.lock();
+      if (!flush || ec) {
+        return;
+      }
+      flush->scheduled = false;
+      if (flush_pending) {
+        // Scheduled again once the write in progress is done
+        return;
+      }
+      if (operation_pending_) {
+        // Try again once the operation in progress is done
+        schedule_flush(executor);
+        return;
+      }
+      if (corked_size_ != 0 && flush->write) {
+        flush->write(executor);
+      }
+    }));
+  }
+
   ctxt_handle& ctxt_handle_;
+  buffer_allocator& allocator_;
+  std::size_t max_write_size_;
+  bool operation_pending_ = false;
+  bool prepared_ = false;
+  bool pipeline_writes_;
+  pooled_buffer corked_data_;
+  std::size_t corked_size_ = 0;
+  waiter* waiters_head_ = nullptr;
+  waiter* waiters_tail_ = nullptr;
+  std::shared_ptr<delayed_flush> delayed_flush_;
+
+  // The buffers holding the records of a write behind, only allocated
+  // when writes are pipelined. The write keeps them until done, but
+  // only keeps a weak reference to the liveness token and does
+  // nothing once the stream has been destroyed or reset.
+  std::shared_ptr<encrypt_buffers> behind_;
+  bool writing_behind_ = false;
+  std::shared_ptr<bool> alive_;
 };
 
 } // namespace detail
@@ -15,11 +15,18 @@ namespace wintls {
 namespace detail {
 namespace sspi_functions {
 
+// The functions called by wintls, copied from the table provided by
+// the system. The table of the system is shared by the whole process
+// and never modified, while tests may replace entries in this copy
+// for observing or scripting the calls made by wintls only.
 inline SecurityFunctionTableA* sspi_function_table() {
-  static SecurityFunctionTableA* impl = InitSecurityInterfaceA();
-  // TODO: Figure out some way to signal this to the user instead of aborting
-  WINTLS_ASSERT_MSG(impl != nullptr, "Unable to initialize SecurityFunctionTable");
-  return impl;
+  static SecurityFunctionTableA table = [] {
+    SecurityFunctionTableA* impl = InitSecurityInterfaceA();
+    // TODO: Figure out some way to signal this to the user instead of aborting
+    WINTLS_ASSERT_MSG(impl != nullptr, "Unable to initialize SecurityFunctionTable");
+    return *impl;
+  }();
+  return &table;
 }
 
 inline SECURITY_STATUS AcquireCredentialsHandleA(SEC_CHAR* pPrincipal,
@@ -9,6 +9,8 @@
 #define WINTLS_DETAIL_SSPI_HANDSHAKE_HPP
 
 #include <wintls/detail/assert.hpp>
+#include <wintls/detail/buffer_policy.hpp>
+#include <wintls/detail/buffer_pool.hpp>
 #include <wintls/detail/config.hpp>
 #include <wintls/detail/sspi_functions.hpp>
 #include <wintls/detail/context_flags.hpp>
@@ -19,7 +21,7 @@
 
 #include <wintls/handshake_type.hpp>
 
-#include <array>
+#include <algorithm>
 #include <memory>
 #include <string>
 
@@ -35,13 +37,13 @@ public:
     error                  // handshake error
   };
 
-  sspi_handshake(context& context, ctxt_handle& ctxt_handle, cred_handle& cred_handle)
+  sspi_handshake(context& context, ctxt_handle& ctxt_handle, cred_handle& cred_handle, buffer_allocator& allocator, const buffer_policy& policy)
     : context_(context)
     , ctxt_handle_(ctxt_handle)
     , cred_handle_(cred_handle)
     , last_error_(SEC_E_OK)
-    , in_buffer_(net::buffer(input_data_)) {
-    input_buffers_[0].pvBuffer = reinterpret_cast<void*>(input_data_.data());
+    , initial_buffer_size_(policy.handshake_buffer_size)
+    , input_data_(allocator, buffer_kind::handshake) {
   }
 
   void operator()(handshake_type type) {
@@ -164,6 +166,7 @@ public:
 
   state operator()() {
     if (last_error_ == SEC_E_OK) {
+      release_input_buffer();
       return state::done;
     }
     if (last_error_ != SEC_I_CONTINUE_NEEDED && last_error_ != SEC_E_INCOMPLETE_MESSAGE) {
@@ -173,67 +176,34 @@ public:
       return state::data_available;
     }
     if (input_buffers_[0].cbBuffer == 0) {
-      return state::data_needed;
+      return input_needed(0);
     }
 
     handshake_output_buffers out_buffers;
     DWORD out_flags = 0;
 
+    input_buffers_[0].pvBuffer = input_data_.data();
     input_buffers_[1].BufferType = SECBUFFER_EMPTY;
     input_buffers_[1].pvBuffer = nullptr;
     input_buffers_[1].cbBuffer = 0;
 
-    switch(handshake_type_) {
-      case handshake_type::client:
-        last_error_ = detail::sspi_functions::InitializeSecurityContextA(cred_handle_.get(),
-                                                                        ctxt_handle_.get(),
-                                                                        const_cast<SEC_CHAR*>(server_hostname_.c_str()),
-                                                                        client_context_flags,
-                                                                        0,
-                                                                        SECURITY_NATIVE_DREP,
-                                                                        input_buffers_.desc(),
-                                                                        0,
-                                                                        nullptr,
-                                                                        out_buffers.desc(),
-                                                                        &out_flags,
-                                                                        nullptr);
-        break;
-      case handshake_type::server: {
-        TimeStamp expiry;
-        DWORD f_context_req = server_context_flags;
-        if (context_.verify_server_certificate_) {
-          f_context_req |= ASC_REQ_MUTUAL_AUTH;
-        }
-        last_error_ = detail::sspi_functions::AcceptSecurityContext(cred_handle_.get(),
-                                                                    ctxt_handle_ ? ctxt_handle_.get() : nullptr,
-                                                                    input_buffers_.desc(),
-                                                                    f_context_req,
-                                                                    SECURITY_NATIVE_DREP,
-                                                                    ctxt_handle_.get(),
-                                                                    out_buffers.desc(),
-                                                                    &out_flags,
-                                                                    &expiry);
-      }
-    }
+    last_error_ = next_token(input_buffers_, out_buffers, out_flags);
     if (input_buffers_[1].BufferType == SECBUFFER_EXTRA) {
       // Some data needs to be reused for the next call, move that to the front for reuse
       const auto previous_size = input_buffers_[0].cbBuffer;
       const auto extra_size = input_buffers_[1].cbBuffer;
-      const auto extra_data_begin = input_data_.begin() + previous_size - extra_size;
-      const auto extra_data_end = input_data_.begin() + previous_size;
+      const auto extra_data_begin = input_data_.data() + previous_size - extra_size;
+      const auto extra_data_end = input_data_.data() + previous_size;
 
-      std::move(extra_data_begin, extra_data_end, input_data_.begin());
+      std::move(extra_data_begin, extra_data_end, input_data_.data());
       input_buffers_[0].cbBuffer = extra_size;
-      in_buffer_ = net::buffer(input_data_) + extra_size;
-
-      WINTLS_ASSERT_MSG(in_buffer_.size() > 0, "buffer not large enough for tls handshake message");
-      return state::data_needed;
+      return input_needed(0);
     } else if (last_error_ == SEC_E_INCOMPLETE_MESSAGE) {
-      WINTLS_ASSERT_MSG(in_buffer_.size() > 0, "buffer not large enough for tls handshake message");
-      return state::data_needed;
+      // Schannel may tell us how much of the message is still missing
+      const std::size_t missing = input_buffers_[1].BufferType == SECBUFFER_MISSING ? input_buffers_[1].cbBuffer : 0;
+      return input_needed(missing);
     } else {
       input_buffers_[0].cbBuffer = 0;
-      in_buffer_ = net::buffer(input_data_);
     }
 
     bool has_buffer_output = out_buffers[0].cbBuffer != 0 && out_buffers[0].pvBuffer != nullptr;
@@ -263,6 +233,7 @@ public:
             return state::data_available;
           }
         }
+        release_input_buffer();
         return state::done;
       }
 
@@ -277,6 +248,34 @@ public:
     }
   }
 
+  // Process a post handshake message, like a TLS 1.3 session ticket
+  // or key update, received after DecryptMessage returned
+  // SEC_I_RENEGOTIATE. Any response to send to the peer is made
+  // available as the output buffer. The size of the input not
+  // consumed is returned in extra_size and, if more input is needed,
+  // the size missing, if known, in missing.
+  SECURITY_STATUS post_handshake(net::mutable_buffer input, std::size_t& extra_size, std::size_t& missing) {
+    handshake_input_buffers input_buffers;
+    input_buffers[0].pvBuffer = input.data();
+    input_buffers[0].cbBuffer = static_cast<ULONG>(input.size());
+    handshake_output_buffers out_buffers;
+    DWORD out_flags = 0;
+
+    const SECURITY_STATUS status = next_token(input_buffers, out_buffers, out_flags);
+    extra_size = 0;
+    missing = 0;
+    if (status == SEC_E_INCOMPLETE_MESSAGE) {
+      extra_size = input.size();
+      missing = input_buffers[1].BufferType == SECBUFFER_MISSING ? input_buffers[1].cbBuffer : 0;
+    } else if (input_buffers[1].BufferType == SECBUFFER_EXTRA) {
+      extra_size = input_buffers[1].cbBuffer;
+    }
+    if (out_buffers[0].cbBuffer != 0 && out_buffers[0].pvBuffer != nullptr) {
+      out_buffer_ = sspi_context_buffer{out_buffers[0].pvBuffer, out_buffers[0].cbBuffer};
+    }
+    return status;
+  }
+
   void size_written(std::size_t size) {
     (void)(size);
     assert(size == out_buffer_.size());
@@ -285,7 +284,6 @@ public:
 
   void size_read(std::size_t size) {
     input_buffers_[0].cbBuffer += static_cast<ULONG>(size);
-    in_buffer_ = net::buffer(input_data_) + input_buffers_[0].cbBuffer;
   }
 
   net::const_buffer out_buffer() {
@@ -293,7 +291,19 @@ public:
   }
 
   net::mutable_buffer in_buffer() {
-    return in_buffer_;
+    return net::buffer(input_data_.data(), input_data_.size()) + input_buffers_[0].cbBuffer;
+  }
+
+  std::size_t buffer_size() const {
+    return input_data_.size();
+  }
+
+  // Forget about any previous handshake. The settings and the input
+  // buffer, if still allocated, are kept.
+  void reset() {
+    last_error_ = SEC_E_OK;
+    out_buffer_ = sspi_context_buffer{};
+    input_buffers_[0].cbBuffer = 0;
   }
 
   wintls::error_code last_error() const {
@@ -323,15 +333,79 @@ public:
   }
 
 private:
+  // Pass the input received from the peer to SSPI, getting back what
+  // to send in return
+  SECURITY_STATUS next_token(handshake_input_buffers& input_buffers, handshake_output_buffers& out_buffers, DWORD& out_flags) {
+    switch(handshake_type_) {
+      case handshake_type::client:
+        return detail::sspi_functions::InitializeSecurityContextA(cred_handle_.get(),
+                                                                 ctxt_handle_.get(),
+                                                                 const_cast<SEC_CHAR*>(server_hostname_.c_str()),
+                                                                 client_context_flags,
+                                                                 0,
+                                                                 SECURITY_NATIVE_DREP,
+                                                                 input_buffers.desc(),
+                                                                 0,
+                                                                 nullptr,
+                                                                 out_buffers.desc(),
+                                                                 &out_flags,
+                                                                 nullptr);
+      case handshake_type::server: {
+        TimeStamp expiry;
+        DWORD f_context_req = server_context_flags;
+        if (context_.verify_server_certificate_) {
+          f_context_req |= ASC_REQ_MUTUAL_AUTH;
+        }
+        return detail::sspi_functions::AcceptSecurityContext(cred_handle_.get(),
+                                                             ctxt_handle_ ? ctxt_handle_.get() : nullptr,
+                                                             input_buffers.desc(),
+                                                             f_context_req,
+                                                             SECURITY_NATIVE_DREP,
+                                                             ctxt_handle_.get(),
+                                                             out_buffers.desc(),
+                                                             &out_flags,
+                                                             &expiry);
+      }
+    }
+    WINTLS_UNREACHABLE_RETURN(SEC_E_INTERNAL_ERROR);
+  }
+
+  // Makes sure there is room for reading at least some more data
+  // from the peer, growing the input buffer if needed but never
+  // beyond the limit set on the context.
+  state input_needed(std::size_t missing) {
+    const std::size_t size_used = input_buffers_[0].cbBuffer;
+    if (input_data_.size() > size_used && input_data_.size() >= size_used + missing) {
+      return state::data_needed;
+    }
+
+    const std::size_t limit = context_.handshake_buffer_limit_;
+    if (size_used >= limit) {
+      last_error_ = SEC_E_BUFFER_TOO_SMALL;
+      return state::error;
+    }
+
+    std::size_t new_size = input_data_.empty() ? initial_buffer_size_ : input_data_.size() * 2;
+    new_size = std::max(new_size, size_used + missing);
+    input_data_.grow(std::min(new_size, limit), size_used);
+    return state::data_needed;
+  }
+
+  void release_input_buffer() {
+    input_data_.release();
+    input_buffers_[0].pvBuffer = nullptr;
+    input_buffers_[0].cbBuffer = 0;
+  }
+
   context& context_;
   ctxt_handle& ctxt_handle_;
   cred_handle& cred_handle_;
 
   SECURITY_STATUS last_error_;
+  std::size_t initial_buffer_size_;
   handshake_type handshake_type_ = handshake_type::client;
-  std::array<char, 0x10000> input_data_;
+  pooled_buffer input_data_;
   sspi_context_buffer out_buffer_;
-  net::mutable_buffer in_buffer_;
   handshake_input_buffers input_buffers_;
   std::string server_hostname_;
   bool check_revocation_ = false;
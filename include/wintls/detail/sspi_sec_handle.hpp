@@ -29,6 +29,11 @@ public:
     return &handle_;
   }
 
+protected:
+  void clear() {
+    handle_ = T{0, 0};
+  }
+
 private:
   T handle_{0, 0};
 };
@@ -36,8 +41,13 @@ private:
 class ctxt_handle : public sspi_sec_handle<CtxtHandle> {
 public:
   ~ctxt_handle() {
+    reset();
+  }
+
+  void reset() {
     if (*this) {
       detail::sspi_functions::DeleteSecurityContext(get());
+      clear();
     }
   }
 };
@@ -45,8 +55,13 @@ public:
 class cred_handle : public sspi_sec_handle<CredHandle> {
 public:
   ~cred_handle() {
+    reset();
+  }
+
+  void reset() {
     if (*this) {
       detail::sspi_functions::FreeCredentialsHandle(get());
+      clear();
     }
   }
 };
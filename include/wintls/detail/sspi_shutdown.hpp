@@ -66,6 +66,10 @@ public:
     buffer_ = sspi_context_buffer{};
   }
 
+  void reset() {
+    buffer_ = sspi_context_buffer{};
+  }
+
 private:
   ctxt_handle& ctxt_handle_;
   cred_handle& cred_handle_;
@@ -8,30 +8,66 @@
 #ifndef WINTLS_DETAIL_SSPI_STREAM_HPP
 #define WINTLS_DETAIL_SSPI_STREAM_HPP
 
+#include <wintls/detail/buffer_policy.hpp>
 #include <wintls/detail/sspi_handshake.hpp>
 #include <wintls/detail/sspi_encrypt.hpp>
 #include <wintls/detail/sspi_decrypt.hpp>
 #include <wintls/detail/sspi_shutdown.hpp>
 #include <wintls/detail/sspi_sec_handle.hpp>
 
+#include <memory>
+
 namespace wintls {
 namespace detail {
 
 class sspi_stream {
 public:
-  sspi_stream(context& ctx)
-    : handshake(ctx, ctxt_handle_, cred_handle_)
-    , encrypt(ctxt_handle_)
-    , decrypt(ctxt_handle_)
+  sspi_stream(context& ctx, const buffer_policy& policy)
+    : sspi_stream(ctx, ctx.buffer_pool_, policy) {
+    pool_ = &ctx.buffer_pool_;
+    pool_->add_stream(sizeof(sspi_stream));
+  }
+
+  sspi_stream(context& ctx, buffer_allocator& allocator, const buffer_policy& policy)
+    : handshake(ctx, ctxt_handle_, cred_handle_, allocator, policy)
+    , encrypt(ctxt_handle_, allocator, policy)
+    , decrypt(ctxt_handle_, handshake, allocator, policy)
     , shutdown(ctxt_handle_, cred_handle_) {
   }
 
+  ~sspi_stream() {
+    if (pool_ != nullptr) {
+      pool_->remove_stream(sizeof(sspi_stream));
+    }
+  }
+
   sspi_stream(sspi_stream&&) = delete;
   sspi_stream& operator=(sspi_stream&&) = delete;
 
+  // Return to the state before any handshake keeping the buffers
+  void reset() {
+    handshake.reset();
+    encrypt.reset();
+    decrypt.reset();
+    shutdown.reset();
+    ctxt_handle_.reset();
+    cred_handle_.reset();
+  }
+
+  wintls::memory_usage memory_usage() const {
+    wintls::memory_usage usage;
+    usage.state = sizeof(sspi_stream);
+    usage.handshake = handshake.buffer_size();
+    usage.decrypt = decrypt.buffer_size();
+    usage.plaintext = decrypt.plaintext_buffer_size();
+    usage.encrypt = encrypt.buffer_size();
+    return usage;
+  }
+
 private:
   ctxt_handle ctxt_handle_;
   cred_handle cred_handle_;
+  buffer_pool* pool_ = nullptr;
 
 public:
   sspi_handshake handshake;
@@ -40,6 +76,83 @@ public:
   sspi_shutdown shutdown;
 };
 
+// Destroys an sspi_stream the way it was allocated, which is either
+// using new or, together with the allocator it was allocated with, by
+// the function given.
+class sspi_stream_deleter {
+public:
+  sspi_stream_deleter() = default;
+
+  sspi_stream_deleter(void* holder, void (*destroy)(void*))
+    : holder_(holder)
+    , destroy_(destroy) {
+  }
+
+  void operator()(sspi_stream* stream) const {
+    if (destroy_ != nullptr) {
+      destroy_(holder_);
+    } else {
+      delete stream;
+    }
+  }
+
+private:
+  void* holder_ = nullptr;
+  void (*destroy_)(void*) = nullptr;
+};
+
+using sspi_stream_ptr = std::unique_ptr<sspi_stream, sspi_stream_deleter>;
+
+inline sspi_stream_ptr make_sspi_stream(context& ctx, const buffer_policy& policy) {
+  return sspi_stream_ptr(new sspi_stream(ctx, policy));
+}
+
+// An sspi_stream allocating its buffers, as well as itself, using a
+// standard allocator instead of the buffer pool of the context.
+template <class Allocator>
+class allocated_sspi_stream {
+  using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<allocated_sspi_stream>;
+  using traits_type = std::allocator_traits<allocator_type>;
+
+public:
+  allocated_sspi_stream(context& ctx, const Allocator& alloc, const buffer_policy& policy)
+    : alloc_(alloc)
+    , allocator_(alloc)
+    , stream(ctx, allocator_, policy) {
+  }
+
+  static sspi_stream_ptr create(context& ctx, const Allocator& alloc, const buffer_policy& policy) {
+    allocator_type holder_alloc(alloc);
+    allocated_sspi_stream* holder = traits_type::allocate(holder_alloc, 1);
+    try {
+      traits_type::construct(holder_alloc, holder, ctx, alloc, policy);
+    } catch (...) {
+      traits_type::deallocate(holder_alloc, holder, 1);
+      throw;
+    }
+    return sspi_stream_ptr(&holder->stream, sspi_stream_deleter(holder, &destroy));
+  }
+
+private:
+  static void destroy(void* ptr) {
+    auto holder = static_cast<allocated_sspi_stream*>(ptr);
+    allocator_type holder_alloc(holder->alloc_);
+    traits_type::destroy(holder_alloc, holder);
+    traits_type::deallocate(holder_alloc, holder, 1);
+  }
+
+  allocator_type alloc_;
+  basic_buffer_allocator<Allocator> allocator_;
+
+public:
+  sspi_stream stream;
+};
+
+template <class Allocator>
+sspi_stream_ptr allocate_sspi_stream(context& ctx, const Allocator& alloc, const buffer_policy& policy) {
+  return allocated_sspi_stream<Allocator>::create(ctx, alloc, policy);
+}
+
 } // namespace detail
 } // namespace wintls
 
@@ -0,0 +1,214 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_DETAIL_WRITE_QUEUE_HPP
+#define WINTLS_DETAIL_WRITE_QUEUE_HPP
+
+#include <wintls/detail/config.hpp>
+#include <wintls/detail/operation_state.hpp>
+
+#include <vector>
+
+namespace wintls {
+namespace detail {
+
+// Asynchronous writes waiting for the write in progress to finish.
+// The operation writing takes all of the queued writes, writes their
+// data along with its own and then hands over writing to the first
+// write queued in the meantime, if any.
+class write_queue {
+public:
+  // Passed to an operation resumed to take over writing
+  struct take_over {};
+
+  // A queued write, allocated using the allocator associated with the
+  // operation and freed before the operation is resumed
+  class entry {
+  public:
+    virtual void gather(std::vector<net::const_buffer>& buffers) const = 0;
+    virtual std::size_t size() const = 0;
+    virtual void complete(const wintls::error_code& ec) = 0;
+    virtual void take_over() = 0;
+
+    // Free the entry without resuming the operation
+    virtual void destroy() = 0;
+
+    const entry* next() const {
+      return next_;
+    }
+
+  protected:
+    ~entry() = default;
+
+  private:
+    friend class write_queue;
+    entry* next_ = nullptr;
+  };
+
+  // Queued writes linked through the entries themselves, so queueing
+  // a write allocates nothing but the entry
+  class entries {
+  public:
+    entries() = default;
+
+    entries(entries&& other) noexcept
+      : head_(other.head_)
+      , tail_(other.tail_) {
+      other.head_ = nullptr;
+      other.tail_ = nullptr;
+    }
+
+    entries& operator=(entries&& other) noexcept {
+      if (this != &other) {
+        clear();
+        head_ = other.head_;
+        tail_ = other.tail_;
+        other.head_ = nullptr;
+        other.tail_ = nullptr;
+      }
+      return *this;
+    }
+
+    ~entries() {
+      clear();
+    }
+
+    bool empty() const {
+      return head_ == nullptr;
+    }
+
+    const entry* front() const {
+      return head_;
+    }
+
+    void push_back(entry* e) {
+      if (tail_ != nullptr) {
+        tail_->next_ = e;
+      } else {
+        head_ = e;
+      }
+      tail_ = e;
+    }
+
+    entry* pop_front() {
+      entry* e = head_;
+      head_ = e->next_;
+      if (head_ == nullptr) {
+        tail_ = nullptr;
+      }
+      e->next_ = nullptr;
+      return e;
+    }
+
+    // Complete all of the writes
+    void complete(const wintls::error_code& ec) {
+      while (!empty()) {
+        pop_front()->complete(ec);
+      }
+    }
+
+  private:
+    void clear() {
+      while (!empty()) {
+        pop_front()->destroy();
+      }
+    }
+
+    entry* head_ = nullptr;
+    entry* tail_ = nullptr;
+  };
+
+  template <typename Self, typename ConstBufferSequence>
+  void push(Self& self, const ConstBufferSequence& buffers) {
+    entries_.push_back(new_operation_state<entry_impl<Self, ConstBufferSequence>>(self, buffers));
+  }
+
+  entries take() {
+    return std::move(entries_);
+  }
+
+  // Gather the data of the writer followed by the data of the writes
+  // taken. Only the writer uses the gathered buffers, which are kept
+  // to avoid allocating them again for every batch.
+  template <typename ConstBufferSequence>
+  void gather(const ConstBufferSequence& buffers, const entries& batch) {
+    gathered.clear();
+    const auto end = net::buffer_sequence_end(buffers);
+    for (auto it = net::buffer_sequence_begin(buffers); it != end; ++it) {
+      gathered.emplace_back(*it);
+    }
+    for (const entry* queued = batch.front(); queued != nullptr; queued = queued->next()) {
+      queued->gather(gathered);
+    }
+  }
+
+  // Hand over writing to the first queued write, if any
+  void next() {
+    if (entries_.empty()) {
+      busy = false;
+      return;
+    }
+    entries_.pop_front()->take_over();
+  }
+
+  bool enabled = false;
+  bool busy = false;
+  std::vector<net::const_buffer> gathered;
+
+private:
+  // The operations are resumed through their own executor, which may
+  // differ from the one the write in progress completes on
+  template <typename Self, typename ConstBufferSequence>
+  class entry_impl final : public entry {
+  public:
+    entry_impl(Self&& self, const ConstBufferSequence& buffers)
+      : self_(std::move(self))
+      , buffers_(buffers) {
+    }
+
+    void gather(std::vector<net::const_buffer>& buffers) const override {
+      const auto end = net::buffer_sequence_end(buffers_);
+      for (auto it = net::buffer_sequence_begin(buffers_); it != end; ++it) {
+        buffers.emplace_back(*it);
+      }
+    }
+
+    std::size_t size() const override {
+      return net::buffer_size(buffers_);
+    }
+
+    void complete(const wintls::error_code& ec) override {
+      const std::size_t size = ec ? 0 : this->size();
+      Self self(std::move(self_));
+      delete_operation_state(this, self);
+      auto e = self.get_executor();
+      net::post(e, [self = std::move(self), ec, size]() mutable { self(ec, size); });
+    }
+
+    void take_over() override {
+      Self self(std::move(self_));
+      delete_operation_state(this, self);
+      auto e = self.get_executor();
+      net::post(e, [self = std::move(self)]() mutable { self(write_queue::take_over{}); });
+    }
+
+    void destroy() override {
+      delete_operation_state(this, self_);
+    }
+
+  private:
+    Self self_;
+    ConstBufferSequence buffers_;
+  };
+
+  entries entries_;
+};
+
+} // namespace detail
+} // namespace wintls
+
+#endif // WINTLS_DETAIL_WRITE_QUEUE_HPP
@@ -0,0 +1,54 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_MEMORY_USAGE_HPP
+#define WINTLS_MEMORY_USAGE_HPP
+
+#include <cstddef>
+
+namespace wintls {
+
+/** Memory used by TLS streams.
+ *
+ * Breakdown in bytes of the memory used by a single @ref stream as
+ * returned by @ref basic_stream::memory_usage or by all streams using a
+ * @ref context as returned by @ref context::memory_usage.
+ *
+ * Memory allocated by SSPI/Schannel itself is not included.
+ */
+struct memory_usage {
+  /// Connection state such as SSPI handles and bookkeeping.
+  std::size_t state = 0;
+
+  /// Buffer for incoming handshake messages.
+  std::size_t handshake = 0;
+
+  /// Buffer for incoming TLS records, including decrypted data not
+  /// yet read by the caller when it is decrypted in place.
+  std::size_t decrypt = 0;
+
+  /// Buffer for decrypted data not yet read by the caller when it is
+  /// copied out of the record, see `copy_plaintext` in @ref
+  /// default_stream_traits.
+  std::size_t plaintext = 0;
+
+  /// Buffer for outgoing TLS records.
+  std::size_t encrypt = 0;
+
+  /// Unused buffers kept for reuse. Only reported by @ref
+  /// context::memory_usage.
+  std::size_t cached = 0;
+
+  /// The total number of bytes used.
+  std::size_t total() const {
+    return state + handshake + decrypt + plaintext + encrypt + cached;
+  }
+};
+
+} // namespace wintls
+
+#endif // WINTLS_MEMORY_USAGE_HPP
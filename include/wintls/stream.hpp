@@ -10,12 +10,19 @@
 
 #include <wintls/error.hpp>
 #include <wintls/handshake_type.hpp>
+#include <wintls/memory_usage.hpp>
+#include <wintls/stream_traits.hpp>
 
 #include <wintls/detail/assert.hpp>
+#include <wintls/detail/async_commit_write.hpp>
+#include <wintls/detail/async_flush.hpp>
 #include <wintls/detail/async_handshake.hpp>
 #include <wintls/detail/async_read.hpp>
+#include <wintls/detail/async_read_dynamic.hpp>
+#include <wintls/detail/async_read_record.hpp>
 #include <wintls/detail/async_shutdown.hpp>
 #include <wintls/detail/async_write.hpp>
+#include <wintls/detail/buffer_policy.hpp>
 #include <wintls/detail/sspi_stream.hpp>
 
 #ifdef WINTLS_USE_STANDALONE_ASIO
@@ -26,27 +33,42 @@
 #include <boost/asio/io_context.hpp>
 #endif // !WINTLS_USE_STANDALONE_ASIO
 
+#include <chrono>
 #include <memory>
+#include <type_traits>
+
+#ifdef WINTLS_HAS_MEMORY_RESOURCE
+#include <memory_resource>
+#endif // WINTLS_HAS_MEMORY_RESOURCE
 
 namespace wintls {
 
 /** Provides stream-oriented functionality using Windows SSPI/Schannel.
  *
- * The stream class template provides asynchronous and blocking
+ * The basic_stream class template provides asynchronous and blocking
  * stream-oriented functionality using Windows SSPI/Schannel.
  *
+ * Most users should use the @ref stream alias which uses the
+ * default buffer policy.
+ *
  * @tparam NextLayer The type representing the next layer, to which
  * data will be read and written during operations. For synchronous
  * operations, the type must support the <em>SyncStream</em> concept.
  * For asynchronous operations, the type must support the
  * <em>AsyncStream</em> concept.
+ *
+ * @tparam Traits The buffer policy of the stream. See @ref
+ * default_stream_traits.
  */
-template<class NextLayer>
-class stream {
+template<class NextLayer, class Traits = default_stream_traits>
+class basic_stream {
 public:
   /// The type of the next layer.
   using next_layer_type = typename std::remove_reference<NextLayer>::type;
 
+  /// The buffer policy of the stream.
+  using traits_type = Traits;
+
   /// The type of the executor associated with the object.
   using executor_type = typename std::remove_reference<next_layer_type>::type::executor_type;
 
@@ -60,9 +82,82 @@ public:
    *  @param ctx The wintls @ref context to be used for the stream.
    */
   template <class Arg>
-  stream(Arg&& arg, context& ctx)
+  basic_stream(Arg&& arg, context& ctx)
     : next_layer_(std::forward<Arg>(arg))
-    , sspi_stream_(std::make_unique<detail::sspi_stream>(ctx)) {
+    , sspi_stream_(detail::make_sspi_stream(ctx, detail::make_buffer_policy<Traits>())) {
+  }
+
+  /** Construct a stream using an allocator.
+   *
+   * This constructor creates a stream and initialises the underlying
+   * stream object. The state of the TLS connection as well as the
+   * buffers used for handshaking and for encrypting and decrypting
+   * TLS records are allocated using the given allocator instead of
+   * being allocated from the @ref context. So is the state shared
+   * with operations continuing in the background, like a delayed
+   * flush, which may be freed after the stream is destroyed. The
+   * state of asynchronous operations is allocated using the
+   * allocator associated with their handlers.
+   *
+   *  @param arg The argument to be passed to initialise the
+   *  underlying stream.
+   *  @param ctx The wintls @ref context to be used for the stream.
+   *  @param alloc The allocator to use for memory owned by the
+   *  stream. Must meet the <em>Allocator</em> requirements. A copy is
+   *  kept for the lifetime of the stream.
+   */
+  template <class Arg, class Allocator, class = typename std::enable_if<!std::is_pointer<Allocator>::value>::type>
+  basic_stream(Arg&& arg, context& ctx, const Allocator& alloc)
+    : next_layer_(std::forward<Arg>(arg))
+    , sspi_stream_(detail::allocate_sspi_stream(ctx, alloc, detail::make_buffer_policy<Traits>())) {
+  }
+
+#ifdef WINTLS_HAS_MEMORY_RESOURCE
+  /** Construct a stream using a memory resource.
+   *
+   * Equivalent to constructing the stream using a
+   * `std::pmr::polymorphic_allocator` for the given memory resource.
+   *
+   *  @param arg The argument to be passed to initialise the
+   *  underlying stream.
+   *  @param ctx The wintls @ref context to be used for the stream.
+   *  @param resource The memory resource to use for memory owned by
+   *  the stream. Must outlive the stream.
+   */
+  template <class Arg>
+  basic_stream(Arg&& arg, context& ctx, std::pmr::memory_resource* resource)
+    : basic_stream(std::forward<Arg>(arg), ctx, std::pmr::polymorphic_allocator<char>(resource)) {
+  }
+#endif // WINTLS_HAS_MEMORY_RESOURCE
+
+  basic_stream(const basic_stream&) = delete;
+  basic_stream& operator=(const basic_stream&) = delete;
+
+  /** Move construct a stream.
+   *
+   * No operations may be in progress on the stream being moved, but
+   * data may still be corked.
+   *
+   * @param other The stream to move from.
+   */
+  basic_stream(basic_stream&& other)
+    : next_layer_(std::forward<NextLayer>(other.next_layer_))
+    , sspi_stream_(std::move(other.sspi_stream_)) {
+    bind_delayed_flush();
+  }
+
+  /** Move assign a stream.
+   *
+   * No operations may be in progress on either stream, but data may
+   * still be corked.
+   *
+   * @param other The stream to move from.
+   */
+  basic_stream& operator=(basic_stream&& other) {
+    next_layer_ = std::forward<NextLayer>(other.next_layer_);
+    sspi_stream_ = std::move(other.sspi_stream_);
+    bind_delayed_flush();
+    return *this;
   }
 
   /** Get the executor associated with the object.
@@ -235,17 +330,34 @@ public:
    * need to ensure that the requested amount of data is read before
    * the blocking operation completes.
    */
-  template <class MutableBufferSequence>
+  template <class MutableBufferSequence, class = typename std::enable_if<!net::is_dynamic_buffer_v2<MutableBufferSequence>::value>::type>
   size_t read_some(const MutableBufferSequence& buffers, wintls::error_code& ec) {
+    sspi_stream_->decrypt.begin_operation();
     detail::sspi_decrypt::state state;
-    while((state = sspi_stream_->decrypt(buffers)) == detail::sspi_decrypt::state::data_needed) {
-      std::size_t size_read = next_layer_.read_some(sspi_stream_->decrypt.input_buffer, ec);
-      if (ec) {
-        return 0;
+    while (true) {
+      state = sspi_stream_->decrypt(buffers);
+      if (state == detail::sspi_decrypt::state::data_needed) {
+        std::size_t size_read = next_layer_.read_some(sspi_stream_->decrypt.input_buffer, ec);
+        if (ec) {
+          sspi_stream_->decrypt.end_operation();
+          return 0;
+        }
+        sspi_stream_->decrypt.size_read(size_read);
+        continue;
       }
-      sspi_stream_->decrypt.size_read(size_read);
-      continue;
+      if (state == detail::sspi_decrypt::state::data_to_write) {
+        // Respond to a post handshake message from the peer
+        std::size_t size_written = net::write(next_layer_, sspi_stream_->decrypt.output_buffer(), ec);
+        if (ec) {
+          sspi_stream_->decrypt.end_operation();
+          return 0;
+        }
+        sspi_stream_->decrypt.size_written(size_written);
+        continue;
+      }
+      break;
     }
+    sspi_stream_->decrypt.end_operation();
 
     if (state == detail::sspi_decrypt::state::error) {
       ec = sspi_stream_->decrypt.last_error();
@@ -272,7 +384,7 @@ public:
    * need to ensure that the requested amount of data is read before
    * the blocking operation completes.
    */
-  template <class MutableBufferSequence>
+  template <class MutableBufferSequence, class = typename std::enable_if<!net::is_dynamic_buffer_v2<MutableBufferSequence>::value>::type>
   size_t read_some(const MutableBufferSequence& buffers) {
     wintls::error_code ec{};
     auto read = read_some(buffers, ec);
@@ -306,11 +418,208 @@ public:
    * requested number of bytes. Consider using the `net::async_read`
    * function if you need to ensure that the requested amount of data
    * is read before the asynchronous operation completes.
+   *
+   * @note Regardless of whether the asynchronous operation completes
+   * immediately or not, the handler will not be invoked from within
+   * this function. When the read is served from data already
+   * decrypted without any I/O, the handler is invoked through the
+   * immediate executor associated with the handler, if supported by
+   * the Asio version in use (1.28 or Boost 1.82 and later), allowing
+   * such reads to complete without a round trip through the
+   * scheduler. Otherwise invocation of the handler will be performed
+   * in a manner equivalent to using `net::post`.
    */
-  template <class MutableBufferSequence, class CompletionToken>
+  template <class MutableBufferSequence, class CompletionToken, class = typename std::enable_if<!net::is_dynamic_buffer_v2<MutableBufferSequence>::value>::type>
   auto async_read_some(const MutableBufferSequence& buffers, CompletionToken&& handler) {
     return net::async_compose<CompletionToken, void(wintls::error_code, std::size_t)>(
-        detail::async_read<next_layer_type, MutableBufferSequence>{next_layer_, buffers, sspi_stream_->decrypt}, handler);
+        detail::async_read<next_layer_type, MutableBufferSequence>{next_layer_, buffers, sspi_stream_->decrypt}, handler, next_layer_);
+  }
+
+  /** Read some data from the stream into a dynamic buffer.
+   *
+   * This function is used to read data from the stream, appending it
+   * to a dynamic buffer. The function call will block until one or
+   * more bytes of data has been read successfully, or until an error
+   * occurs.
+   *
+   * The dynamic buffer is grown by just enough for the decrypted data
+   * already available or the next TLS record to be read in full,
+   * avoiding decrypted data being left over for the following reads.
+   * Without any data buffered the buffer is grown by the size of the
+   * largest record, allowing the record to be decrypted in place in
+   * the dynamic buffer. Any space not used is removed from the buffer
+   * again.
+   *
+   * @param buffers The dynamic buffer, meeting the DynamicBuffer_v2
+   * requirements, into which the data will be read.
+   * @param ec Set to indicate what error occurred, if any. Set to
+   * `net::error::no_buffer_space` if the dynamic buffer has already
+   * reached its maximum size.
+   *
+   * @returns The number of bytes read.
+   */
+  template <class DynamicBuffer, class = typename std::enable_if<net::is_dynamic_buffer_v2<DynamicBuffer>::value>::type>
+  size_t read_some(DynamicBuffer buffers, wintls::error_code& ec) {
+    const std::size_t size = detail::dynamic_read_size(buffers, sspi_stream_->decrypt);
+    if (size == 0) {
+      ec = net::error::no_buffer_space;
+      return 0;
+    }
+    const std::size_t position = buffers.size();
+    buffers.grow(size);
+    const std::size_t size_read = read_some(buffers.data(position, size), ec);
+    buffers.shrink(size - size_read);
+    return size_read;
+  }
+
+  /** Read some data from the stream into a dynamic buffer.
+   *
+   * This function is used to read data from the stream, appending it
+   * to a dynamic buffer. The function call will block until one or
+   * more bytes of data has been read successfully, or until an error
+   * occurs. The dynamic buffer is grown as described for the
+   * overload taking an error code.
+   *
+   * @param buffers The dynamic buffer, meeting the DynamicBuffer_v2
+   * requirements, into which the data will be read.
+   *
+   * @returns The number of bytes read.
+   *
+   * @throws wintls::system_error Thrown on failure.
+   */
+  template <class DynamicBuffer, class = typename std::enable_if<net::is_dynamic_buffer_v2<DynamicBuffer>::value>::type>
+  size_t read_some(DynamicBuffer buffers) {
+    wintls::error_code ec{};
+    auto read = read_some(std::move(buffers), ec);
+    if (ec) {
+      detail::throw_error(ec);
+    }
+    return read;
+  }
+
+  /** Start an asynchronous read into a dynamic buffer.
+   *
+   * This function is used to asynchronously read one or more bytes of
+   * data from the stream, appending it to a dynamic buffer. The
+   * function call always returns immediately. The dynamic buffer is
+   * grown as described for @ref read_some, sizing the read by the
+   * next TLS record.
+   *
+   * @param buffers The dynamic buffer, meeting the DynamicBuffer_v2
+   * requirements, into which the data will be read. Although the
+   * dynamic buffer object may be copied as necessary, ownership of
+   * the underlying memory is retained by the caller, which must
+   * guarantee that it remains valid until the handler is called.
+   * @param handler The handler to be called when the read operation
+   * completes.  Copies will be made of the handler as required. The
+   * equivalent function signature of the handler must be:
+   * @code
+   * void handler(
+   *     const wintls::error_code& error, // Result of operation.
+   *     std::size_t bytes_transferred    // Number of bytes read.
+   * ); @endcode
+   */
+  template <class DynamicBuffer, class CompletionToken, class = typename std::enable_if<net::is_dynamic_buffer_v2<DynamicBuffer>::value>::type>
+  auto async_read_some(DynamicBuffer buffers, CompletionToken&& handler) {
+    return net::async_compose<CompletionToken, void(wintls::error_code, std::size_t)>(
+        detail::async_read_dynamic<next_layer_type, DynamicBuffer>{next_layer_, std::move(buffers), sspi_stream_->decrypt}, handler, next_layer_);
+  }
+
+  /** Read a single TLS record from the stream.
+   *
+   * This function is used to read the data of a single TLS record
+   * without copying it. The record is decrypted in place in the
+   * buffer of the stream and a view of its data is returned. The
+   * function call will block until a record with data has been
+   * received, or until an error occurs.
+   *
+   * If a previous read left some of the data of a record unread,
+   * the rest of that record is returned instead.
+   *
+   * @param ec Set to indicate what error occurred, if any.
+   *
+   * @returns A view of the data of the record, valid until the next
+   * operation on the stream.
+   */
+  net::const_buffer read_record(wintls::error_code& ec) {
+    sspi_stream_->decrypt.begin_operation();
+    detail::sspi_decrypt::state state;
+    while (true) {
+      state = sspi_stream_->decrypt.read_record();
+      if (state == detail::sspi_decrypt::state::data_needed) {
+        std::size_t size_read = next_layer_.read_some(sspi_stream_->decrypt.input_buffer, ec);
+        if (ec) {
+          sspi_stream_->decrypt.end_operation();
+          return {};
+        }
+        sspi_stream_->decrypt.size_read(size_read);
+        continue;
+      }
+      if (state == detail::sspi_decrypt::state::data_to_write) {
+        // Respond to a post handshake message from the peer
+        std::size_t size_written = net::write(next_layer_, sspi_stream_->decrypt.output_buffer(), ec);
+        if (ec) {
+          sspi_stream_->decrypt.end_operation();
+          return {};
+        }
+        sspi_stream_->decrypt.size_written(size_written);
+        continue;
+      }
+      break;
+    }
+
+    sspi_stream_->decrypt.end_operation();
+    if (state == detail::sspi_decrypt::state::error) {
+      ec = sspi_stream_->decrypt.last_error();
+      return {};
+    }
+
+    return sspi_stream_->decrypt.record;
+  }
+
+  /** Read a single TLS record from the stream.
+   *
+   * This function is used to read the data of a single TLS record
+   * without copying it. The record is decrypted in place in the
+   * buffer of the stream and a view of its data is returned. The
+   * function call will block until a record with data has been
+   * received, or until an error occurs.
+   *
+   * @returns A view of the data of the record, valid until the next
+   * operation on the stream.
+   *
+   * @throws wintls::system_error Thrown on failure.
+   */
+  net::const_buffer read_record() {
+    wintls::error_code ec{};
+    auto record = read_record(ec);
+    if (ec) {
+      detail::throw_error(ec);
+    }
+    return record;
+  }
+
+  /** Start an asynchronous read of a single TLS record.
+   *
+   * This function is used to asynchronously read the data of a
+   * single TLS record without copying it. The function call always
+   * returns immediately.
+   *
+   * @param handler The handler to be called when the read operation
+   * completes.  Copies will be made of the handler as required. The
+   * equivalent function signature of the handler must be:
+   * @code
+   * void handler(
+   *     const wintls::error_code& error, // Result of operation.
+   *     net::const_buffer record         // The data of the record,
+   *                                      // valid until the next
+   *                                      // operation on the stream.
+   * ); @endcode
+   */
+  template <class CompletionToken>
+  auto async_read_record(CompletionToken&& handler) {
+    return net::async_compose<CompletionToken, void(wintls::error_code, net::const_buffer)>(
+        detail::async_read_record<next_layer_type>{next_layer_, sspi_stream_->decrypt}, handler, next_layer_);
   }
 
   /** Write some data to the stream.
@@ -319,6 +628,10 @@ public:
    * call will block until one or more bytes of data has been written
    * successfully, or until an error occurs.
    *
+   * Up to `Traits::max_write_size` bytes of data are encrypted into
+   * as many TLS records as needed, all written to the next layer at
+   * once.
+   *
    * @param buffers The data to be written.
    * @param ec Set to indicate what error occurred, if any.
    *
@@ -331,12 +644,16 @@ public:
    */
   template <class ConstBufferSequence>
   std::size_t write_some(const ConstBufferSequence& buffers, wintls::error_code& ec) {
-    std::size_t bytes_consumed = sspi_stream_->encrypt(buffers, ec);
-    if (ec) {
+    if (!sspi_stream_->encrypt.begin_sync_operation(ec)) {
       return 0;
     }
+    bool ready = false;
+    std::size_t bytes_consumed = sspi_stream_->encrypt.write(buffers, ready, ec);
+    if (ready) {
+      net::write(next_layer_, sspi_stream_->encrypt.buffers.encrypted_data(), detail::transfer_all_records{}, ec);
+    }
+    sspi_stream_->encrypt.end_operation();
 
-    net::write(next_layer_, sspi_stream_->encrypt.buffers, ec);
     if (ec) {
       return 0;
     }
@@ -376,7 +693,17 @@ public:
    *
    * This function is used to asynchronously write one or more bytes
    * of data to the stream. The function call always returns
-   * immediately.
+   * immediately. Up to `Traits::max_write_size` bytes of data are
+   * encrypted into as many TLS records as needed, all written to the
+   * next layer at once. If `Traits::pipeline_writes` is true, the
+   * operation completes once the write to the next layer has been
+   * started, and the following write encrypts its data while that
+   * write is still in progress. The write continues through the
+   * executor of the operation, which must be a strand if the stream
+   * is used from several threads. Any error is reported by the
+   * following write or flush, and @ref async_flush completes once
+   * the write is done. Synchronous operations fail with
+   * `net::error::in_progress` in the meantime.
    *
    * @param buffers The data to be written to the stream. Although the
    * buffers object may be copied as necessary, ownership of the
@@ -395,23 +722,299 @@ public:
    * @note The `async_write_some` operation may not transmit all of
    * the data to the peer. Consider using the `net::async_write`
    * function if you need to ensure that all data is written before
-   * the asynchronous operation completes.
+   * the asynchronous operation completes, or enable the write queue
+   * with @ref set_write_queue.
    */
   template <class ConstBufferSequence, class CompletionToken>
   auto async_write_some(const ConstBufferSequence& buffers, CompletionToken&& handler) {
     return net::async_compose<CompletionToken, void(wintls::error_code, std::size_t)>(
-        detail::async_write<next_layer_type, ConstBufferSequence>{next_layer_, buffers, sspi_stream_->encrypt}, handler);
+        detail::async_write<next_layer_type, ConstBufferSequence>{next_layer_, buffers, sspi_stream_->encrypt}, handler, next_layer_);
+  }
+
+  /** Enable or disable queueing of asynchronous writes.
+   *
+   * By default only a single @ref async_write_some operation may be
+   * in progress at a time. With the write queue enabled, further
+   * asynchronous writes may be started while one is in progress.
+   * They are queued and written in the order started, with the data
+   * of all the writes queued while the previous write was in
+   * progress encrypted into as few TLS records as possible and
+   * written to the next layer at once.
+   *
+   * A queued write always transmits all of its data, completing with
+   * the size of its own data. Data already corked is written first,
+   * but queued writes are not corked themselves.
+   *
+   * The write queue must not be enabled or disabled while a write is
+   * in progress, and synchronous writes, @ref async_flush and @ref
+   * async_commit_write must not be used while queued writes are in
+   * progress. As with any other operation on the stream, all of the
+   * writes must be started from the same implicit or explicit
+   * strand.
+   *
+   * @param enable Whether to queue asynchronous writes.
+   */
+  void set_write_queue(bool enable) {
+    sspi_stream_->encrypt.queue.enabled = enable;
+  }
+
+  /** Enable or disable cork mode.
+   *
+   * In cork mode, data written to the stream is collected into a
+   * single TLS record instead of being encrypted and written to the
+   * next layer right away. The record is only encrypted and written
+   * once full, when @ref flush or @ref async_flush is called or, for
+   * data written using @ref async_write_some, when the given delay
+   * has expired. This saves the overhead of a TLS record and a write
+   * to the next layer for each of the small writes done by chatty
+   * protocols. Writes of at least a full record while nothing is
+   * corked are written right away.
+   *
+   * Flushing after a delay is done by an asynchronous operation run
+   * through the executor of the write which corked the data. It is
+   * abandoned if the stream is destroyed in the meantime. Any error
+   * is reported by the following write or flush. Synchronous writes
+   * and flushes as well as @ref prepare_write fail with
+   * `net::error::in_progress` while such a flush is being written.
+   *
+   * Disabling cork mode does not write any data already corked, which
+   * is written by the next write or flush.
+   *
+   * @param cork Whether to enable cork mode.
+   * @param delay The time after which data corked by an asynchronous
+   * write is flushed, or zero for only flushing when the record is
+   * full or when explicitly flushed.
+   */
+  void set_cork(bool cork, std::chrono::steady_clock::duration delay = std::chrono::steady_clock::duration::zero()) {
+    sspi_stream_->encrypt.corked = cork;
+    sspi_stream_->encrypt.set_flush_delay(cork ? delay : std::chrono::steady_clock::duration::zero(), next_layer_.get_executor());
+    bind_delayed_flush();
+  }
+
+  /** Write any corked data to the stream.
+   *
+   * This function encrypts any data collected in cork mode and writes
+   * it to the next layer. The function call will block until the data
+   * has been written, or until an error occurs.
+   *
+   * @param ec Set to indicate what error occurred, if any.
+   */
+  void flush(wintls::error_code& ec) {
+    if (!sspi_stream_->encrypt.begin_sync_operation(ec)) {
+      return;
+    }
+    if (sspi_stream_->encrypt.flush(ec)) {
+      net::write(next_layer_, sspi_stream_->encrypt.buffers.encrypted_data(), detail::transfer_all_records{}, ec);
+    }
+    sspi_stream_->encrypt.end_operation();
+  }
+
+  /** Write any corked data to the stream.
+   *
+   * This function encrypts any data collected in cork mode and writes
+   * it to the next layer. The function call will block until the data
+   * has been written, or until an error occurs.
+   *
+   * @throws wintls::system_error Thrown on failure.
+   */
+  void flush() {
+    wintls::error_code ec{};
+    flush(ec);
+    if (ec) {
+      detail::throw_error(ec);
+    }
+  }
+
+  /** Start an asynchronous write of any corked data.
+   *
+   * This function encrypts any data collected in cork mode and
+   * asynchronously writes it to the next layer. The function call
+   * always returns immediately. Completes once any pipelined write
+   * still being written is done, reporting its error if it failed.
+   *
+   * @param handler The handler to be called when the flush operation
+   * completes. Copies will be made of the handler as required. The
+   * equivalent function signature of the handler must be:
+   * @code
+   * void handler(
+   *     const wintls::error_code& error // Result of operation.
+   * );
+   * @endcode
+   */
+  template <class CompletionToken>
+  auto async_flush(CompletionToken&& handler) {
+    return net::async_compose<CompletionToken, void(wintls::error_code)>(
+        detail::async_flush<next_layer_type>{next_layer_, sspi_stream_->encrypt}, handler, next_layer_);
+  }
+
+  /** Get a buffer for data to be written to the stream.
+   *
+   * This function returns a buffer inside the buffer of the stream
+   * used for encrypting, between the space reserved for the header
+   * and the trailer of a TLS record. Data serialized directly into
+   * the buffer is encrypted in place by @ref commit_write, avoiding
+   * copying it.
+   *
+   * The buffer is valid until the data is committed, which must be
+   * done before any other write operation on the stream. Data
+   * already corked is encrypted into a record preceding it, which is
+   * written along with it, but the data prepared is never corked.
+   *
+   * @param size The size of the data to be written. The buffer
+   * returned is limited to the maximum size of a single TLS record.
+   * @param ec Set to indicate what error occurred, if any.
+   *
+   * @returns The buffer to write the data into.
+   */
+  net::mutable_buffer prepare_write(std::size_t size, wintls::error_code& ec) {
+    if (!sspi_stream_->encrypt.begin_sync_operation(ec)) {
+      return {};
+    }
+    const auto buffer = sspi_stream_->encrypt.prepare(size, ec);
+    if (ec) {
+      sspi_stream_->encrypt.end_operation();
+    }
+    return buffer;
+  }
+
+  /** Get a buffer for data to be written to the stream.
+   *
+   * This function returns a buffer inside the buffer of the stream
+   * used for encrypting, as described for the overload taking an
+   * error code.
+   *
+   * @param size The size of the data to be written. The buffer
+   * returned is limited to the maximum size of a single TLS record.
+   *
+   * @returns The buffer to write the data into.
+   *
+   * @throws wintls::system_error Thrown on failure.
+   */
+  net::mutable_buffer prepare_write(std::size_t size) {
+    wintls::error_code ec{};
+    auto buffer = prepare_write(size, ec);
+    if (ec) {
+      detail::throw_error(ec);
+    }
+    return buffer;
+  }
+
+  /** Write data prepared with @ref prepare_write to the stream.
+   *
+   * This function encrypts the data written into the buffer returned
+   * by @ref prepare_write in place and writes the resulting TLS
+   * record to the next layer. The function call will block until the
+   * record has been written, or until an error occurs. Fails with
+   * `net::error::invalid_argument` if no buffer has been prepared or
+   * if the size exceeds the size of the buffer.
+   *
+   * @param size The number of bytes written into the buffer, at most
+   * the size of the buffer.
+   * @param ec Set to indicate what error occurred, if any.
+   *
+   * @returns The number of bytes written.
+   */
+  std::size_t commit_write(std::size_t size, wintls::error_code& ec) {
+    if (!sspi_stream_->encrypt.prepared()) {
+      ec = net::error::invalid_argument;
+      return 0;
+    }
+    std::size_t bytes_consumed = sspi_stream_->encrypt.encrypt_prepared(size, ec);
+    if (!ec) {
+      net::write(next_layer_, sspi_stream_->encrypt.buffers.encrypted_data(), detail::transfer_all_records{}, ec);
+    }
+    sspi_stream_->encrypt.end_operation();
+
+    if (ec) {
+      return 0;
+    }
+
+    return bytes_consumed;
+  }
+
+  /** Write data prepared with @ref prepare_write to the stream.
+   *
+   * This function encrypts the data written into the buffer returned
+   * by @ref prepare_write in place and writes the resulting TLS
+   * record to the next layer. The function call will block until the
+   * record has been written, or until an error occurs. Fails with
+   * `net::error::invalid_argument` if no buffer has been prepared or
+   * if the size exceeds the size of the buffer.
+   *
+   * @param size The number of bytes written into the buffer, at most
+   * the size of the buffer.
+   *
+   * @returns The number of bytes written.
+   *
+   * @throws wintls::system_error Thrown on failure.
+   */
+  std::size_t commit_write(std::size_t size) {
+    wintls::error_code ec{};
+    auto wrote = commit_write(size, ec);
+    if (ec) {
+      detail::throw_error(ec);
+    }
+    return wrote;
+  }
+
+  /** Start an asynchronous write of data prepared with @ref prepare_write.
+   *
+   * This function encrypts the data written into the buffer returned
+   * by @ref prepare_write in place and asynchronously writes the
+   * resulting TLS record to the next layer. The function call always
+   * returns immediately. The operation fails with
+   * `net::error::invalid_argument` if no buffer has been prepared or
+   * if the size exceeds the size of the buffer.
+   *
+   * @param size The number of bytes written into the buffer, at most
+   * the size of the buffer.
+   * @param handler The handler to be called when the write operation
+   * completes.  Copies will be made of the handler as required. The
+   * equivalent function signature of the handler must be:
+   * @code
+   * void handler(
+   *     const wintls::error_code& error, // Result of operation.
+   *     std::size_t bytes_transferred    // Number of bytes written.
+   * );
+   * @endcode
+   */
+  template <class CompletionToken>
+  auto async_commit_write(std::size_t size, CompletionToken&& handler) {
+    return net::async_compose<CompletionToken, void(wintls::error_code, std::size_t)>(
+        detail::async_commit_write<next_layer_type>{next_layer_, size, sspi_stream_->encrypt}, handler, next_layer_);
   }
 
   /** Shut down TLS on the stream.
    *
    * This function is used to shut down TLS on the stream. The
    * function call will block until TLS has been shut down or an
-   * error occurs.
+   * error occurs. Any data still corked is written first. Fails with
+   * `net::error::in_progress` while a pipelined write or a delayed
+   * flush is still being written, and with the error of such a write
+   * if it failed.
    *
    * @param ec Set to indicate what error occurred, if any.
    */
   void shutdown(wintls::error_code& ec) {
+    if (sspi_stream_->encrypt.flush_pending) {
+      // Can't wait for records being written in the background
+      ec = net::error::in_progress;
+      return;
+    }
+    // A pipelined write or a delayed flush which failed is reported
+    // instead of shutting down
+    if (sspi_stream_->encrypt.flush_error) {
+      ec = sspi_stream_->encrypt.flush_error;
+      sspi_stream_->encrypt.flush_error = {};
+      return;
+    }
+    // Data still corked goes ahead of the close_notify
+    if (sspi_stream_->encrypt.corked_size() != 0) {
+      flush(ec);
+      if (ec) {
+        return;
+      }
+    }
     ec = sspi_stream_->shutdown();
     if (ec) {
       return;
@@ -441,7 +1044,11 @@ public:
   /** Asynchronously shut down TLS on the stream.
    *
    * This function is used to asynchronously shut down TLS on the
-   * stream. This function call always returns immediately.
+   * stream. This function call always returns immediately. A
+   * pipelined write or a delayed flush still being written is
+   * completed first, and any data still corked is written before
+   * shutting down. Fails with the error of such a write if it
+   * failed.
    *
    * @param handler The handler to be called when the shutdown
    * operation completes. Copies will be made of the handler as
@@ -455,14 +1062,224 @@ public:
   template <class CompletionToken>
   auto async_shutdown(CompletionToken&& handler) {
     return net::async_compose<CompletionToken, void(wintls::error_code)>(
-        detail::async_shutdown<next_layer_type>{next_layer_, sspi_stream_->shutdown}, handler);
+        detail::async_shutdown<next_layer_type>{next_layer_, sspi_stream_->shutdown, sspi_stream_->encrypt}, handler, next_layer_);
+  }
+
+  /** Reset the stream for reuse.
+   *
+   * Returns the stream to the state it was in before performing the
+   * TLS handshake, discarding the security context of the current
+   * connection and any data buffered. This allows reusing stream
+   * objects, for example from a pool of connections, without the
+   * cost of constructing them again.
+   *
+   * Settings such as the SNI hostname and revocation checking as
+   * well as buffers already allocated are kept. Cork mode is
+   * disabled and any data corked is discarded, along with a delayed
+   * flush of it not yet written. The next layer is not affected and
+   * typically needs to be closed and reconnected separately.
+   *
+   * @note No operations may be in progress on the stream when
+   * calling this function. This includes a pipelined write or a
+   * delayed flush still being written to the next layer, which @ref
+   * async_flush waits for.
+   */
+  void reset() {
+    sspi_stream_->reset();
+  }
+
+  /** Get the memory used by the stream.
+   *
+   * Reports the memory currently used by the stream for the state of
+   * the TLS connection and for the buffers used for handshaking and
+   * for decrypting and encrypting TLS records. The stream object
+   * itself and the next layer are not included.
+   *
+   * @return The memory used in bytes.
+   */
+  wintls::memory_usage memory_usage() const {
+    return sspi_stream_->memory_usage();
+  }
+
+  /** Release memory held by idle buffers.
+   *
+   * Releases the buffers used for encrypting and decrypting TLS
+   * records back to the @ref context they were allocated from,
+   * provided they hold no data not yet returned to the caller and
+   * no operation using them is in progress. The buffers are
+   * allocated again when needed by the next read or write.
+   *
+   * Useful for reducing the memory used by connections which are
+   * idle for long periods of time.
+   */
+  void shrink_to_fit() {
+    sspi_stream_->decrypt.release_buffers();
+    sspi_stream_->encrypt.release_buffers();
+  }
+
+  /** Release idle buffers automatically.
+   *
+   * When enabled, the buffers used for encrypting and decrypting
+   * TLS records are released as described for @ref shrink_to_fit
+   * whenever a read or write operation completes.
+   *
+   * This trades memory for the cost of acquiring the buffers from
+   * the @ref context again on every operation. Disabled by default.
+   *
+   * @param release Whether to release idle buffers automatically.
+   */
+  void set_release_idle_buffers(bool release) {
+    sspi_stream_->decrypt.release_when_idle = release;
+    sspi_stream_->encrypt.release_when_idle = release;
+  }
+
+  /** Limit the amount of data read ahead.
+   *
+   * Sets the maximum number of bytes of encrypted data read from the
+   * next layer before being decrypted. Once the limit is reached,
+   * only the data needed for completing the TLS record currently
+   * being received is read until the application has read the data
+   * already buffered.
+   *
+   * Decrypted data not fitting in the buffers passed to a read is
+   * kept until read by the following reads and no data is read from
+   * the next layer in the meantime. Together with this limit, this
+   * puts a bound on the memory used for buffering incoming data by
+   * streams with slow consumers.
+   *
+   * @param limit The maximum number of bytes to read ahead or zero
+   * for only being limited by the size of the buffer for incoming
+   * records, which is the default.
+   */
+  void set_read_ahead_limit(std::size_t limit) {
+    sspi_stream_->decrypt.read_ahead_limit = limit;
+  }
+
+  /** Adapt the amount of data read ahead to the traffic.
+   *
+   * Starts out reading at most `min` bytes of encrypted data ahead
+   * from the next layer. The amount is doubled each time a read from
+   * the next layer fills all of the space offered, as happens when
+   * the peer is streaming bulk data, up to `max` bytes, and halved
+   * again when reads return less than half of it, as happens with
+   * interactive traffic. This reduces the number of reads from the
+   * next layer for bulk transfers while keeping connections
+   * exchanging small messages from buffering more than needed.
+   *
+   * The buffer for incoming records is grown to fit the amount read
+   * ahead, but never beyond the maximum record buffer size of the
+   * stream's traits. A limit set by @ref set_read_ahead_limit still
+   * applies.
+   *
+   * Fails with `net::error::invalid_argument`, leaving the bounds
+   * unchanged, if `max` is not zero and `min` is zero or greater than
+   * `max`.
+   *
+   * @param min The initial and smallest number of bytes to read
+   * ahead. Must be greater than zero.
+   * @param max The largest number of bytes to read ahead, or zero for
+   * disabling adapting the amount read ahead, which is the default.
+   * @param ec Set to indicate what error occurred, if any.
+   */
+  void set_adaptive_read_ahead(std::size_t min, std::size_t max, wintls::error_code& ec) {
+    if (max != 0 && (min == 0 || min > max)) {
+      ec = net::error::invalid_argument;
+      return;
+    }
+    sspi_stream_->decrypt.set_read_ahead_bounds(min, max);
+  }
+
+  /** Adapt the amount of data read ahead to the traffic.
+   *
+   * Starts out reading at most `min` bytes of encrypted data ahead
+   * from the next layer. The amount is doubled each time a read from
+   * the next layer fills all of the space offered, as happens when
+   * the peer is streaming bulk data, up to `max` bytes, and halved
+   * again when reads return less than half of it, as happens with
+   * interactive traffic. This reduces the number of reads from the
+   * next layer for bulk transfers while keeping connections
+   * exchanging small messages from buffering more than needed.
+   *
+   * The buffer for incoming records is grown to fit the amount read
+   * ahead, but never beyond the maximum record buffer size of the
+   * stream's traits. A limit set by @ref set_read_ahead_limit still
+   * applies.
+   *
+   * Fails with `net::error::invalid_argument`, leaving the bounds
+   * unchanged, if `max` is not zero and `min` is zero or greater than
+   * `max`.
+   *
+   * @param min The initial and smallest number of bytes to read
+   * ahead. Must be greater than zero.
+   * @param max The largest number of bytes to read ahead, or zero for
+   * disabling adapting the amount read ahead, which is the default.
+   *
+   * @throws wintls::system_error Thrown on failure.
+   */
+  void set_adaptive_read_ahead(std::size_t min, std::size_t max) {
+    wintls::error_code ec{};
+    set_adaptive_read_ahead(min, max, ec);
+    if (ec) {
+      detail::throw_error(ec);
+    }
+  }
+
+  /** Get the amount of decrypted data available.
+   *
+   * Similar to `SSL_pending` in OpenSSL, this returns the number of
+   * bytes already decrypted which the next read will deliver without
+   * reading from the next layer.
+   *
+   * @return The number of decrypted bytes not yet read.
+   */
+  std::size_t pending() const {
+    return sspi_stream_->decrypt.pending();
+  }
+
+  /** Get the amount of encrypted data buffered.
+   *
+   * Returns the number of bytes read from the next layer but not yet
+   * decrypted. This includes any complete TLS records, which the
+   * next read will decrypt without reading from the next layer, as
+   * well as a partially received record.
+   *
+   * Together with @ref pending this can be used to determine whether
+   * data can be read from the stream without waiting on the next
+   * layer.
+   *
+   * @return The number of encrypted bytes buffered.
+   */
+  std::size_t buffered_ciphertext() const {
+    return sspi_stream_->decrypt.buffered_ciphertext();
   }
 
 private:
+  // The delayed flush writes to the next layer of the stream which
+  // currently owns the state, if any as it may have been moved from
+  void bind_delayed_flush() {
+    if (!sspi_stream_) {
+      return;
+    }
+    sspi_stream_->encrypt.set_flush_write([this](const detail::flush_executor& executor) {
+      sspi_stream_->encrypt.write_corked(next_layer_, executor);
+    });
+  }
+
   NextLayer next_layer_;
-  std::unique_ptr<detail::sspi_stream> sspi_stream_;
+  detail::sspi_stream_ptr sspi_stream_;
 };
 
+
+/** Provides stream-oriented functionality using Windows SSPI/Schannel.
+ *
+ * A @ref basic_stream using the @ref default_stream_traits buffer
+ * policy.
+ *
+ * @tparam NextLayer The type representing the next layer.
+ */
+template<class NextLayer>
+using stream = basic_stream<NextLayer>;
+
 } // namespace wintls
 
 #endif // WINTLS_STREAM_HPP
@@ -0,0 +1,91 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_STREAM_TRAITS_HPP
+#define WINTLS_STREAM_TRAITS_HPP
+
+#include <cstddef>
+
+namespace wintls {
+
+/** Default buffer policy used by @ref basic_stream.
+ *
+ * Controls at compile time how a @ref basic_stream sizes and uses its
+ * buffers. Custom policies can be provided by deriving from this type,
+ * redefining the static members to change and using it as the
+ * `Traits` template argument of @ref basic_stream.
+ */
+struct default_stream_traits {
+  /// Initial size of the buffer used for incoming handshake
+  /// messages. The buffer is grown as needed up to the limit set by
+  /// @ref context::set_handshake_buffer_limit.
+  static constexpr std::size_t handshake_buffer_size = 0x1000;
+
+  /// Initial size of the buffer used for incoming TLS records. If
+  /// zero, the buffer is sized to hold a single record of the maximum
+  /// size negotiated during the handshake. A larger buffer allows
+  /// reading ahead more data from the next layer at once.
+  static constexpr std::size_t record_buffer_size = 0;
+
+  /// Size the buffer used for incoming TLS records is never grown
+  /// beyond, even if a peer sends records larger than negotiated.
+  static constexpr std::size_t max_record_buffer_size = 0x10000;
+
+  /// Whether decrypted data not fitting in the buffers passed to a
+  /// read is copied to a separate buffer instead of being served from
+  /// the record it was decrypted in. Copying allows the buffer for
+  /// incoming records to be released while decrypted data is still
+  /// waiting to be read.
+  static constexpr bool copy_plaintext = false;
+
+  /// Maximum amount of data encrypted by a single write. Writes
+  /// larger than a single TLS record are encrypted into as many
+  /// records as needed, all written to the next layer at once. If
+  /// zero, each write is limited to a single record of the maximum
+  /// size negotiated during the handshake.
+  static constexpr std::size_t max_write_size = 0x10000;
+
+  /// Whether asynchronous writes complete once their records have
+  /// started being written to the next layer, using a second encrypt
+  /// buffer so that the following write is encrypted while the
+  /// previous one is still being written. Keeps the next layer busy
+  /// for large transfers at the cost of the memory of the second
+  /// buffer and of errors being reported by the following operation,
+  /// which is why it is disabled by default.
+  static constexpr bool pipeline_writes = false;
+};
+
+/** Buffer policy minimizing memory usage.
+ *
+ * Starts out with small buffers, only growing them when receiving
+ * messages not fitting and copies any decrypted data not yet read to
+ * a buffer of its own. Suitable for many mostly idle connections
+ * exchanging small messages, especially combined with @ref
+ * basic_stream::set_release_idle_buffers.
+ */
+struct minimal_memory_stream_traits : default_stream_traits {
+  static constexpr std::size_t handshake_buffer_size = 0x800;
+  static constexpr std::size_t record_buffer_size = 0x400;
+  static constexpr bool copy_plaintext = true;
+  static constexpr std::size_t max_write_size = 0;
+};
+
+/** Buffer policy for bulk data transfer.
+ *
+ * Uses buffers for incoming records and for encrypting writes large
+ * enough for several records, reducing the number of reads from and
+ * writes to the next layer at the cost of memory.
+ */
+struct bulk_transfer_stream_traits : default_stream_traits {
+  static constexpr std::size_t record_buffer_size = 0x10000;
+  static constexpr std::size_t max_record_buffer_size = 0x40000;
+  static constexpr std::size_t max_write_size = 0x40000;
+};
+
+} // namespace wintls
+
+#endif // WINTLS_STREAM_TRAITS_HPP
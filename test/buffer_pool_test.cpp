@@ -0,0 +1,160 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "unittest.hpp"
+
+#include <wintls/detail/buffer_pool.hpp>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using wintls::detail::buffer_pool;
+using wintls::detail::buffer_kind;
+using wintls::detail::pooled_buffer;
+
+TEST_CASE("buffer pool") {
+  buffer_pool pool;
+  CHECK(pool.in_use() == 0);
+  CHECK(pool.cached() == 0);
+
+  SECTION("released buffers are reused") {
+    auto ptr = pool.allocate(0x1000, buffer_kind::decrypt);
+    CHECK(pool.in_use() == 1);
+    pool.deallocate(ptr, 0x1000, buffer_kind::decrypt);
+    CHECK(pool.in_use() == 0);
+    CHECK(pool.cached() == 1);
+
+    CHECK(pool.allocate(0x1000, buffer_kind::decrypt) == ptr);
+    CHECK(pool.in_use() == 1);
+    CHECK(pool.cached() == 0);
+    pool.deallocate(ptr, 0x1000, buffer_kind::decrypt);
+  }
+
+  SECTION("buffers are only reused for the same size") {
+    auto ptr = pool.allocate(0x1000, buffer_kind::decrypt);
+    pool.deallocate(ptr, 0x1000, buffer_kind::decrypt);
+    auto other = pool.allocate(0x2000, buffer_kind::decrypt);
+    CHECK(pool.cached() == 1);
+    CHECK(pool.in_use() == 1);
+    pool.deallocate(other, 0x2000, buffer_kind::decrypt);
+    CHECK(pool.cached() == 2);
+  }
+
+  SECTION("cache limit") {
+    pool.set_cache_limit(1);
+    auto first = pool.allocate(0x1000, buffer_kind::decrypt);
+    auto second = pool.allocate(0x1000, buffer_kind::decrypt);
+    pool.deallocate(first, 0x1000, buffer_kind::decrypt);
+    pool.deallocate(second, 0x1000, buffer_kind::decrypt);
+    CHECK(pool.in_use() == 0);
+    CHECK(pool.cached() == 1);
+  }
+
+  SECTION("buffers released on other threads") {
+    auto ptr = pool.allocate(0x1000, buffer_kind::decrypt);
+    std::thread([&pool, ptr] {
+      pool.deallocate(ptr, 0x1000, buffer_kind::decrypt);
+      CHECK(pool.cached() == 1);
+    }).join();
+    // The releasing thread has exited taking its cache with it
+    CHECK(pool.cached() == 0);
+    CHECK(pool.in_use() == 0);
+  }
+
+  SECTION("cache limit with buffers released concurrently") {
+    pool.set_cache_limit(4);
+    constexpr int thread_count = 8;
+    std::atomic<int> released{0};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i) {
+      threads.emplace_back([&pool, &released, &done] {
+        for (int j = 0; j < 10; ++j) {
+          pool.deallocate(pool.allocate(0x1000, buffer_kind::decrypt), 0x1000, buffer_kind::decrypt);
+        }
+        ++released;
+        // Keep the thread and its cache alive until all are done
+        while (!done) {
+          std::this_thread::yield();
+        }
+      });
+    }
+    while (released != thread_count) {
+      std::this_thread::yield();
+    }
+    CHECK(pool.cached() <= 4);
+    CHECK(pool.memory_usage().cached <= 4 * 0x1000);
+    done = true;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    CHECK(pool.cached() == 0);
+  }
+
+  SECTION("moved from pool") {
+    auto ptr = pool.allocate(0x1000, buffer_kind::decrypt);
+    buffer_pool other(std::move(pool));
+    CHECK(other.in_use() == 1);
+    CHECK(pool.in_use() == 0);
+
+    // The moved from pool can still be used
+    auto moved_from = pool.allocate(0x1000, buffer_kind::decrypt);
+    CHECK(pool.in_use() == 1);
+    pool.deallocate(moved_from, 0x1000, buffer_kind::decrypt);
+    CHECK(pool.cached() == 1);
+
+    other.deallocate(ptr, 0x1000, buffer_kind::decrypt);
+    CHECK(other.in_use() == 0);
+    CHECK(other.cached() == 1);
+  }
+
+  SECTION("pooled buffer") {
+    pooled_buffer buffer(pool, buffer_kind::handshake);
+    CHECK(buffer.empty());
+
+    buffer.allocate(4);
+    std::memcpy(buffer.data(), "abcd", 4);
+    CHECK(pool.in_use() == 1);
+
+    buffer.grow(8, 3);
+    CHECK(buffer.size() == 8);
+    CHECK(std::string(buffer.data(), 3) == "abc");
+    CHECK(pool.in_use() == 1);
+    CHECK(pool.cached() == 1);
+
+    buffer.release();
+    CHECK(buffer.empty());
+    CHECK(pool.in_use() == 0);
+    CHECK(pool.cached() == 2);
+  }
+
+  SECTION("memory usage") {
+    pooled_buffer handshake(pool, buffer_kind::handshake);
+    pooled_buffer encrypt(pool, buffer_kind::encrypt);
+    handshake.allocate(0x1000);
+    encrypt.allocate(0x2000);
+    pool.add_stream(100);
+
+    auto usage = pool.memory_usage();
+    CHECK(usage.state == 100);
+    CHECK(usage.handshake == 0x1000);
+    CHECK(usage.decrypt == 0);
+    CHECK(usage.plaintext == 0);
+    CHECK(usage.encrypt == 0x2000);
+    CHECK(usage.cached == 0);
+
+    handshake.release();
+    pool.remove_stream(100);
+    usage = pool.memory_usage();
+    CHECK(usage.state == 0);
+    CHECK(usage.handshake == 0);
+    CHECK(usage.cached == 0x1000);
+    CHECK(usage.total() == 0x3000);
+  }
+}
@@ -578,6 +578,30 @@ TEST_CASE("failing handshakes") {
   }
 }
 
+TEST_CASE("handshake buffer limit") {
+  wintls::context client_ctx(wintls::method::system_default);
+  // The server certificate alone is larger than this
+  client_ctx.set_handshake_buffer_limit(0x100);
+
+  net::io_context io_context;
+  wintls::stream<test_stream> client_stream(io_context, client_ctx);
+  asio_ssl_server_stream server(io_context);
+
+  client_stream.next_layer().connect(server.stream.next_layer());
+
+  error_code client_error{};
+  client_stream.async_handshake(wintls::handshake_type::client,
+                                [&client_error, &client_stream](const error_code& ec) {
+                                  client_error = ec;
+                                  client_stream.next_layer().close();
+                                });
+
+  server.stream.async_handshake(asio_ssl::stream_base::server, [](const error_code&) {});
+  io_context.run();
+  CHECK(client_error.category() == get_system_category());
+  CHECK(client_error.value() == SEC_E_BUFFER_TOO_SMALL);
+}
+
 TEST_CASE("ssl/tls versions") {
   const auto value = GENERATE(values<std::pair<wintls::method, tls_version>>({
         { wintls::method::tlsv1, tls_version::tls_1_0 },
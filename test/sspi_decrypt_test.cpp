@@ -0,0 +1,100 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "unittest.hpp"
+#include "asio_ssl_server_stream.hpp"
+#include "echo_server.hpp"
+#include "sspi_hook.hpp"
+
+#include <wintls.hpp>
+
+#include <string>
+
+TEST_CASE("decrypt calls per record") {
+  net::io_context io_context;
+  wintls::context client_ctx(wintls::method::system_default);
+
+  echo_server<asio_ssl_server_stream> server(io_context);
+  wintls::stream<test_stream> client_stream(io_context, client_ctx);
+  client_stream.next_layer().connect(server.stream.next_layer());
+
+  auto handshake_result = server.handshake();
+  client_stream.handshake(wintls::handshake_type::client);
+  REQUIRE_FALSE(handshake_result.get());
+
+  const std::string message(1000, 'x');
+  const std::size_t records = 10;
+  for (std::size_t i = 0; i < records; ++i) {
+    net::write(server.stream, net::buffer(message));
+  }
+
+  SECTION("single byte reads") {
+    client_stream.next_layer().read_size(1);
+  }
+
+  SECTION("MTU sized reads") {
+    client_stream.next_layer().read_size(1460);
+  }
+
+  // SSPI is only called once a complete record has been received
+  decrypt_message_counter counter;
+  std::string received(records * message.size(), '\0');
+  net::read(client_stream, net::buffer(&received[0], received.size()));
+  CHECK(received == std::string(records * message.size(), 'x'));
+  CHECK(counter.calls() == records);
+}
+
+TEST_CASE("post handshake message") {
+  net::io_context io_context;
+  wintls::context client_ctx(wintls::method::system_default);
+
+  echo_server<asio_ssl_server_stream> server(io_context);
+  wintls::stream<test_stream> client_stream(io_context, client_ctx);
+  client_stream.next_layer().connect(server.stream.next_layer());
+
+  auto handshake_result = server.handshake();
+  client_stream.handshake(wintls::handshake_type::client);
+  REQUIRE_FALSE(handshake_result.get());
+
+  // The first record is taken for a post handshake message
+  const std::string ticket = "session ticket";
+  const std::string message(1000, 'x');
+  net::write(server.stream, net::buffer(ticket));
+  net::write(server.stream, net::buffer(message));
+
+  post_handshake_script script;
+  const auto writes = client_stream.next_layer().nwrite();
+  std::string received(message.size(), '\0');
+
+  SECTION("sync read") {
+    net::read(client_stream, net::buffer(&received[0], received.size()));
+  }
+
+  SECTION("async read") {
+    wintls::error_code error{};
+    net::async_read(client_stream, net::buffer(&received[0], received.size()), [&error](const wintls::error_code& ec, std::size_t) {
+      error = ec;
+    });
+    io_context.run();
+    CHECK_FALSE(error);
+  }
+
+  // The data following the message is delivered as usual
+  CHECK(received == message);
+  CHECK(script.message_size() != 0);
+
+  // The response is written to the next layer by the read, ahead of
+  // any application data written afterwards
+  CHECK(client_stream.next_layer().nwrite() == writes + 1);
+  net::write(client_stream, net::buffer(message));
+  std::string response(post_handshake_script::response().size(), '\0');
+  net::read(server.stream.next_layer(), net::buffer(&response[0], response.size()));
+  CHECK(response == post_handshake_script::response());
+  std::string echoed(message.size(), '\0');
+  net::read(server.stream, net::buffer(&echoed[0], echoed.size()));
+  CHECK(echoed == message);
+}
@@ -0,0 +1,204 @@
+//
+// Copyright (c) 2024 Kasper Laudrup (laudrup at stacktrace dot dk)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef WINTLS_TEST_SSPI_HOOK_HPP
+#define WINTLS_TEST_SSPI_HOOK_HPP
+
+#include <wintls/detail/sspi_functions.hpp>
+
+#include <cstddef>
+#include <string>
+
+// Replaces a function in the SSPI function table used by wintls for
+// the lifetime of the object, making it possible to observe or script
+// the calls made into SSPI. The table is the copy owned by wintls, not
+// the one of the system, and the original function is restored by the
+// destructor even if the test fails.
+template <class Function>
+class sspi_hook {
+public:
+  using entry_type = Function SecurityFunctionTableA::*;
+
+  sspi_hook(entry_type entry, Function replacement)
+    : entry_(entry)
+    , original_(table()->*entry) {
+    table()->*entry_ = replacement;
+  }
+
+  ~sspi_hook() noexcept {
+    table()->*entry_ = original_;
+  }
+
+  sspi_hook(const sspi_hook&) = delete;
+  sspi_hook& operator=(const sspi_hook&) = delete;
+
+  Function original() const {
+    return original_;
+  }
+
+private:
+  static SecurityFunctionTableA* table() {
+    return wintls::detail::sspi_functions::sspi_function_table();
+  }
+
+  entry_type entry_;
+  Function original_;
+};
+
+// Counts the calls to DecryptMessage
+class decrypt_message_counter {
+public:
+  decrypt_message_counter()
+    : hook_(&SecurityFunctionTableA::DecryptMessage, &decrypt_message) {
+    original() = hook_.original();
+    count() = 0;
+  }
+
+  std::size_t calls() const {
+    return count();
+  }
+
+private:
+  static SECURITY_STATUS SEC_ENTRY decrypt_message(PCtxtHandle context, PSecBufferDesc message, unsigned long seq_no, unsigned long* qop) {
+    ++count();
+    return original()(context, message, seq_no, qop);
+  }
+
+  static std::size_t& count() {
+    static std::size_t value = 0;
+    return value;
+  }
+
+  static DECRYPT_MESSAGE_FN& original() {
+    static DECRYPT_MESSAGE_FN value = nullptr;
+    return value;
+  }
+
+  sspi_hook<DECRYPT_MESSAGE_FN> hook_;
+};
+
+// Makes the first call to DecryptMessage return SEC_I_RENEGOTIATE
+// as if the first record received was a TLS 1.3 post handshake
+// message, handing all of the input back as extra data, and scripts
+// InitializeSecurityContext to consume that record and respond with
+// a token to send to the peer. The record is decrypted and its
+// contents discarded for keeping the sequence of the records in sync
+// with the peer.
+class post_handshake_script {
+public:
+  post_handshake_script()
+    : decrypt_hook_(&SecurityFunctionTableA::DecryptMessage, &decrypt_message)
+    , initialize_hook_(&SecurityFunctionTableA::InitializeSecurityContextA, &initialize_security_context)
+    , free_hook_(&SecurityFunctionTableA::FreeContextBuffer, &free_context_buffer) {
+    original_decrypt() = decrypt_hook_.original();
+    original_initialize() = initialize_hook_.original();
+    original_free() = free_hook_.original();
+    injected() = false;
+    token_size() = 0;
+  }
+
+  // The size of the message consumed by InitializeSecurityContext, if
+  // called
+  std::size_t message_size() const {
+    return token_size();
+  }
+
+  // The token sent in response to the message
+  static const std::string& response() {
+    static const std::string value = "post handshake response";
+    return value;
+  }
+
+private:
+  static SECURITY_STATUS SEC_ENTRY decrypt_message(PCtxtHandle context, PSecBufferDesc message, unsigned long seq_no, unsigned long* qop) {
+    if (injected()) {
+      return original_decrypt()(context, message, seq_no, qop);
+    }
+    injected() = true;
+    message->pBuffers[3].BufferType = SECBUFFER_EXTRA;
+    message->pBuffers[3].pvBuffer = message->pBuffers[0].pvBuffer;
+    message->pBuffers[3].cbBuffer = message->pBuffers[0].cbBuffer;
+    return SEC_I_RENEGOTIATE;
+  }
+
+  static SECURITY_STATUS SEC_ENTRY initialize_security_context(PCredHandle credentials, PCtxtHandle context, SEC_CHAR* target, unsigned long flags,
+                                                               unsigned long reserved1, unsigned long data_rep, PSecBufferDesc input,
+                                                               unsigned long reserved2, PCtxtHandle new_context, PSecBufferDesc output,
+                                                               unsigned long* attributes, PTimeStamp expiry) {
+    if (token_size() != 0) {
+      return original_initialize()(credentials, context, target, flags, reserved1, data_rep, input, reserved2, new_context, output, attributes, expiry);
+    }
+
+    // Consume the first record of the input
+    const auto data = static_cast<unsigned char*>(input->pBuffers[0].pvBuffer);
+    const std::size_t size = input->pBuffers[0].cbBuffer;
+    const std::size_t record_size = 5 + (static_cast<std::size_t>(data[3]) << 8 | data[4]);
+    if (size < record_size) {
+      input->pBuffers[1].BufferType = SECBUFFER_MISSING;
+      input->pBuffers[1].cbBuffer = static_cast<unsigned long>(record_size - size);
+      return SEC_E_INCOMPLETE_MESSAGE;
+    }
+    SecBuffer buffers[4]{};
+    buffers[0].BufferType = SECBUFFER_DATA;
+    buffers[0].pvBuffer = data;
+    buffers[0].cbBuffer = static_cast<unsigned long>(record_size);
+    SecBufferDesc record{SECBUFFER_VERSION, 4, buffers};
+    const SECURITY_STATUS status = original_decrypt()(context, &record, 0, nullptr);
+    if (status != SEC_E_OK) {
+      return status;
+    }
+    token_size() = record_size;
+
+    if (size > record_size) {
+      input->pBuffers[1].BufferType = SECBUFFER_EXTRA;
+      input->pBuffers[1].cbBuffer = static_cast<unsigned long>(size - record_size);
+    }
+    output->pBuffers[0].BufferType = SECBUFFER_TOKEN;
+    output->pBuffers[0].pvBuffer = const_cast<char*>(response().data());
+    output->pBuffers[0].cbBuffer = static_cast<unsigned long>(response().size());
+    return SEC_E_OK;
+  }
+
+  // The response is not allocated by SSPI
+  static SECURITY_STATUS SEC_ENTRY free_context_buffer(PVOID buffer) {
+    if (buffer == response().data()) {
+      return SEC_E_OK;
+    }
+    return original_free()(buffer);
+  }
+
+  static bool& injected() {
+    static bool value = false;
+    return value;
+  }
+
+  static std::size_t& token_size() {
+    static std::size_t value = 0;
+    return value;
+  }
+
+  static DECRYPT_MESSAGE_FN& original_decrypt() {
+    static DECRYPT_MESSAGE_FN value = nullptr;
+    return value;
+  }
+
+  static INIT_SECURITY_CONTEXT_FN_A& original_initialize() {
+    static INIT_SECURITY_CONTEXT_FN_A value = nullptr;
+    return value;
+  }
+
+  static FREE_CONTEXT_BUFFER_FN& original_free() {
+    static FREE_CONTEXT_BUFFER_FN value = nullptr;
+    return value;
+  }
+
+  sspi_hook<DECRYPT_MESSAGE_FN> decrypt_hook_;
+  sspi_hook<INIT_SECURITY_CONTEXT_FN_A> initialize_hook_;
+  sspi_hook<FREE_CONTEXT_BUFFER_FN> free_hook_;
+};
+
+#endif // WINTLS_TEST_SSPI_HOOK_HPP
@@ -18,13 +18,24 @@
 #include <wintls/detail/config.hpp>
 
 #ifdef WINTLS_USE_STANDALONE_ASIO
+#include <asio/bind_executor.hpp>
 #include <asio/io_context.hpp>
+#include <asio/post.hpp>
+#include <asio/strand.hpp>
 #else // WINTLS_USE_STANDALONE_ASIO
+#include <boost/asio/bind_executor.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
 #endif // !WINTLS_USE_STANDALONE_ASIO
 
 #include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <thread>
+#include <type_traits>
+#include <vector>
 #include <string>
 
 class test_server : public async_echo_server<asio_ssl_server_stream> {
@@ -37,6 +48,83 @@ public:
   }
 };
 
+// A client stream connected to an echo server with the handshake done
+template <class Traits = wintls::default_stream_traits>
+struct connected_stream {
+  connected_stream()
+    : server(io_context)
+    , client_stream(io_context, client_ctx) {
+    client_stream.next_layer().connect(server.stream.next_layer());
+
+    auto handshake_result = server.handshake();
+    client_stream.handshake(wintls::handshake_type::client);
+    REQUIRE_FALSE(handshake_result.get());
+  }
+
+  net::io_context io_context;
+  wintls::context client_ctx{wintls::method::system_default};
+  echo_server<asio_ssl_server_stream> server;
+  wintls::basic_stream<test_stream, Traits> client_stream;
+};
+
+struct allocation_counter {
+  std::size_t allocated = 0;
+  std::size_t deallocated = 0;
+};
+
+template <class T>
+struct counting_allocator {
+  using value_type = T;
+
+  explicit counting_allocator(allocation_counter& counter)
+    : counter(&counter) {
+  }
+
+  template <class U>
+  counting_allocator(const counting_allocator<U>& other)
+    : counter(other.counter) {
+  }
+
+  T* allocate(std::size_t n) {
+    counter->allocated += n * sizeof(T);
+    return std::allocator<T>{}.allocate(n);
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    counter->deallocated += n * sizeof(T);
+    std::allocator<T>{}.deallocate(p, n);
+  }
+
+  allocation_counter* counter;
+};
+
+template <class T, class U>
+bool operator==(const counting_allocator<T>& lhs, const counting_allocator<U>& rhs) {
+  return lhs.counter == rhs.counter;
+}
+
+template <class T, class U>
+bool operator!=(const counting_allocator<T>& lhs, const counting_allocator<U>& rhs) {
+  return !(lhs == rhs);
+}
+
+// A write handler with a counting allocator associated
+struct counting_write_handler {
+  using allocator_type = counting_allocator<char>;
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(*counter);
+  }
+
+  void operator()(const wintls::error_code& ec, std::size_t) const {
+    REQUIRE_FALSE(ec);
+    ++*completed;
+  }
+
+  allocation_counter* counter;
+  std::size_t* completed;
+};
+
 TEST_CASE("moved stream") {
   net::io_context ioc;
 
@@ -71,6 +159,13 @@ TEST_CASE("moved stream") {
   ioc.run();
   CHECK_FALSE(client_ec);
   CHECK_FALSE(server_ec);
+
+  // Streams are movable, but never copyable, not even when the next
+  // layer is a reference
+  CHECK(std::is_move_constructible<wintls::stream<test_stream>>::value);
+  CHECK_FALSE(std::is_copy_constructible<wintls::stream<test_stream>>::value);
+  CHECK_FALSE(std::is_copy_constructible<wintls::stream<test_stream&>>::value);
+  CHECK_FALSE(std::is_copy_assignable<wintls::stream<test_stream&>>::value);
 }
 
 TEST_CASE("handshake not done") {
@@ -256,3 +351,874 @@ TEST_CASE("small reads") {
     CHECK(client.data<std::string>() == test_data);
   }
 }
+
+TEST_CASE("stream buffers are pooled") {
+  using namespace std::string_literals;
+
+  net::io_context io_context;
+  const auto test_data = "Der er et yndigt land\0"s;
+  wintls::context client_ctx(wintls::method::system_default);
+
+  {
+    echo_server<asio_ssl_server_stream> server(io_context);
+    wintls::stream<test_stream> client_stream(io_context, client_ctx);
+    client_stream.next_layer().connect(server.stream.next_layer());
+
+    auto handshake_result = server.handshake();
+    client_stream.handshake(wintls::handshake_type::client);
+    REQUIRE_FALSE(handshake_result.get());
+
+    // The handshake buffer has been handed back for reuse
+    CHECK(client_ctx.buffers_in_use() == 0);
+    CHECK(client_ctx.buffers_cached() > 0);
+
+    net::write(client_stream, net::buffer(test_data));
+    server.read();
+    server.write();
+    net::streambuf buffer;
+    net::read_until(client_stream, buffer, '\0');
+    CHECK(client_ctx.buffers_in_use() > 0);
+  }
+
+  CHECK(client_ctx.buffers_in_use() == 0);
+  CHECK(client_ctx.buffers_cached() > 0);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "release idle buffers") {
+  using namespace std::string_literals;
+
+  const auto test_data = "Der er et yndigt land\0"s;
+
+  auto echo = [&]() {
+    net::write(client_stream, net::buffer(test_data));
+    server.read();
+    server.write();
+    net::streambuf buffer;
+    net::read_until(client_stream, buffer, '\0');
+    return std::string(net::buffers_begin(buffer.data()), net::buffers_end(buffer.data()));
+  };
+
+  SECTION("shrink to fit") {
+    CHECK(echo() == test_data);
+    CHECK(client_ctx.buffers_in_use() == 2);
+
+    auto usage = client_stream.memory_usage();
+    CHECK(usage.handshake == 0);
+    CHECK(usage.decrypt > 0);
+    CHECK(usage.plaintext == 0);
+    CHECK(usage.encrypt > 0);
+    auto ctx_usage = client_ctx.memory_usage();
+    CHECK(ctx_usage.state == usage.state);
+    CHECK(ctx_usage.decrypt == usage.decrypt);
+    CHECK(ctx_usage.encrypt == usage.encrypt);
+
+    client_stream.shrink_to_fit();
+    CHECK(client_ctx.buffers_in_use() == 0);
+    usage = client_stream.memory_usage();
+    CHECK(usage.decrypt == 0);
+    CHECK(usage.encrypt == 0);
+    CHECK(usage.total() == usage.state);
+
+    CHECK(echo() == test_data);
+    CHECK(client_ctx.buffers_in_use() == 2);
+  }
+
+  SECTION("automatically") {
+    client_stream.set_release_idle_buffers(true);
+    CHECK(echo() == test_data);
+    CHECK(client_ctx.buffers_in_use() == 0);
+    CHECK(echo() == test_data);
+    CHECK(client_ctx.buffers_in_use() == 0);
+  }
+}
+
+TEST_CASE("stream with allocator") {
+  using namespace std::string_literals;
+
+  net::io_context io_context;
+  const auto test_data = "Der er et yndigt land\0"s;
+  wintls::context client_ctx(wintls::method::system_default);
+  allocation_counter counter;
+
+  {
+    echo_server<asio_ssl_server_stream> server(io_context);
+    wintls::stream<test_stream> client_stream(io_context, client_ctx, counting_allocator<char>(counter));
+    client_stream.next_layer().connect(server.stream.next_layer());
+    CHECK(counter.allocated > 0);
+
+    auto handshake_result = server.handshake();
+    client_stream.handshake(wintls::handshake_type::client);
+    REQUIRE_FALSE(handshake_result.get());
+
+    net::write(client_stream, net::buffer(test_data));
+    server.read();
+    server.write();
+    net::streambuf buffer;
+    net::read_until(client_stream, buffer, '\0');
+    CHECK(std::string(net::buffers_begin(buffer.data()), net::buffers_end(buffer.data())) == test_data);
+
+    // Nothing is allocated from the context
+    CHECK(client_ctx.buffers_in_use() == 0);
+    CHECK(client_ctx.buffers_cached() == 0);
+
+    // Neither is the state for flushing corked data after a delay
+    const auto allocated = counter.allocated;
+    client_stream.set_cork(true, std::chrono::milliseconds(10));
+    CHECK(counter.allocated > allocated);
+  }
+
+  CHECK(counter.allocated == counter.deallocated);
+}
+
+TEST_CASE("reset stream") {
+  using namespace std::string_literals;
+
+  net::io_context io_context;
+  const auto test_data = "Der er et yndigt land\0"s;
+  wintls::context client_ctx(wintls::method::system_default);
+  wintls::stream<test_stream> client_stream(io_context, client_ctx);
+
+  for (int i = 0; i < 3; ++i) {
+    echo_server<asio_ssl_server_stream> server(io_context);
+    client_stream.next_layer() = test_stream(io_context);
+    client_stream.next_layer().connect(server.stream.next_layer());
+
+    auto handshake_result = server.handshake();
+    client_stream.handshake(wintls::handshake_type::client);
+    REQUIRE_FALSE(handshake_result.get());
+
+    net::write(client_stream, net::buffer(test_data));
+    server.read();
+    server.write();
+    net::streambuf buffer;
+    net::read_until(client_stream, buffer, '\0');
+    CHECK(std::string(net::buffers_begin(buffer.data()), net::buffers_end(buffer.data())) == test_data);
+
+    auto shutdown_result = server.shutdown();
+    client_stream.shutdown();
+    REQUIRE_FALSE(shutdown_result.get());
+
+    client_stream.reset();
+
+    // The buffers are kept for the next connection
+    CHECK(client_ctx.buffers_in_use() == 2);
+  }
+
+  // Resetting abandons a delayed flush of data corked on the
+  // previous connection
+  {
+    echo_server<asio_ssl_server_stream> server(io_context);
+    client_stream.next_layer() = test_stream(io_context);
+    client_stream.next_layer().connect(server.stream.next_layer());
+
+    auto handshake_result = server.handshake();
+    client_stream.handshake(wintls::handshake_type::client);
+    REQUIRE_FALSE(handshake_result.get());
+
+    const auto writes = client_stream.next_layer().nwrite();
+    client_stream.set_cork(true, std::chrono::milliseconds(10));
+    bool corked = false;
+    client_stream.async_write_some(net::buffer(test_data), [&corked](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      corked = true;
+    });
+    io_context.restart();
+    io_context.poll();
+    REQUIRE(corked);
+
+    client_stream.reset();
+    io_context.restart();
+    io_context.run();
+    CHECK(client_stream.next_layer().nwrite() == writes);
+
+    // Nothing is left pending for the next connection
+    wintls::error_code ec{};
+    client_stream.flush(ec);
+    CHECK_FALSE(ec);
+  }
+}
+
+TEST_CASE_METHOD(connected_stream<wintls::minimal_memory_stream_traits>, "stream traits") {
+  using namespace std::string_literals;
+
+  const auto test_data = "Der er et yndigt land\0"s;
+
+  net::write(client_stream, net::buffer(test_data));
+  server.read();
+  server.write();
+
+  std::string received(4, '\0');
+  CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == received.size());
+
+  // The plaintext not yet read is kept in a buffer of its own, so the
+  // buffer for incoming records can be released
+  client_stream.shrink_to_fit();
+  auto usage = client_stream.memory_usage();
+  CHECK(usage.decrypt == 0);
+  CHECK(usage.plaintext == test_data.size() - received.size());
+  CHECK(usage.encrypt == 0);
+  CHECK(client_ctx.memory_usage().plaintext == usage.plaintext);
+
+  net::streambuf buffer;
+  net::read_until(client_stream, buffer, '\0');
+  received += std::string(net::buffers_begin(buffer.data()), net::buffers_end(buffer.data()));
+  CHECK(received == test_data);
+
+  client_stream.shrink_to_fit();
+  CHECK(client_stream.memory_usage().decrypt == 0);
+  CHECK(client_stream.memory_usage().plaintext == 0);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "read ahead limit") {
+  const std::string message = "Der er et yndigt land";
+  const auto messages = 3;
+  for (auto i = 0; i < messages; ++i) {
+    net::write(server.stream, net::buffer(message));
+  }
+
+  std::string received(message.size(), '\0');
+  SECTION("no limit") {
+    CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == message.size());
+    CHECK(received == message);
+    CHECK(client_stream.next_layer().buffer().size() == 0);
+  }
+
+  SECTION("limited") {
+    client_stream.set_read_ahead_limit(1);
+    for (auto i = 0; i < messages; ++i) {
+      CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == message.size());
+      CHECK(received == message);
+      // Only a single record is read at a time
+      CHECK((client_stream.next_layer().buffer().size() > 0) == (i < messages - 1));
+    }
+  }
+}
+
+TEST_CASE_METHOD(connected_stream<>, "multiple records per read") {
+  const std::string message = "Der er et yndigt land";
+  const std::size_t messages = 3;
+  for (std::size_t i = 0; i < messages; ++i) {
+    net::write(server.stream, net::buffer(message));
+  }
+
+  // All records received are decrypted by a single read
+  std::string received(messages * message.size() + 1, '\0');
+  CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == messages * message.size());
+  received.resize(messages * message.size());
+  CHECK(received == message + message + message);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "large reads decrypt in place") {
+  std::string message(0x8000, '\0');
+  for (std::size_t i = 0; i < message.size(); ++i) {
+    message[i] = static_cast<char>('a' + i % 26);
+  }
+  net::write(server.stream, net::buffer(message));
+
+  // A buffer large enough for any record is used for reading and
+  // decrypting the records without any buffer of the stream's own
+  std::string received;
+  std::vector<char> buffer(0x10000);
+  while (received.size() < message.size()) {
+    const auto size = client_stream.read_some(net::buffer(buffer));
+    received.append(buffer.data(), size);
+    CHECK(client_stream.memory_usage().decrypt == 0);
+  }
+  CHECK(received == message);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "async read served from decrypted data") {
+  const std::string message = "Der er et yndigt land";
+  net::write(server.stream, net::buffer(message));
+
+  std::string received(4, '\0');
+  CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == received.size());
+
+  std::string rest(message.size(), '\0');
+  bool completed = false;
+  auto handler = [&](const wintls::error_code& ec, std::size_t size) {
+    CHECK_FALSE(ec);
+    rest.resize(size);
+    completed = true;
+  };
+
+  SECTION("default") {
+    client_stream.async_read_some(net::buffer(&rest[0], rest.size()), handler);
+    // Never invoked from within the initiating function
+    CHECK_FALSE(completed);
+    io_context.run();
+  }
+
+  SECTION("strand") {
+    auto strand = net::make_strand(io_context);
+    client_stream.async_read_some(net::buffer(&rest[0], rest.size()),
+                                  net::bind_executor(strand, [&](const wintls::error_code& ec, std::size_t size) {
+                                    // Completed within the strand of the handler
+                                    CHECK(strand.running_in_this_thread());
+                                    handler(ec, size);
+                                  }));
+    CHECK_FALSE(completed);
+    io_context.run();
+  }
+
+#ifdef WINTLS_HAS_IMMEDIATE_EXECUTOR
+  SECTION("immediate executor") {
+    client_stream.async_read_some(net::buffer(&rest[0], rest.size()),
+                                  net::bind_immediate_executor(net::system_executor(), handler));
+    // Completed without any round trip through the io_context
+    CHECK(completed);
+  }
+#endif // WINTLS_HAS_IMMEDIATE_EXECUTOR
+
+  CHECK(completed);
+  CHECK(received + rest == message);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "pending data") {
+  CHECK(client_stream.pending() == 0);
+  CHECK(client_stream.buffered_ciphertext() == 0);
+
+  const std::string message = "Der er et yndigt land";
+  net::write(server.stream, net::buffer(message));
+  net::write(server.stream, net::buffer(message));
+
+  std::string received(4, '\0');
+  CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == received.size());
+  CHECK(client_stream.pending() == message.size() - received.size());
+  // The second record has been read but not decrypted
+  CHECK(client_stream.buffered_ciphertext() > message.size());
+  CHECK(client_stream.next_layer().buffer().size() == 0);
+
+  received.resize(message.size());
+  CHECK(client_stream.read_some(net::buffer(&received[4], received.size() - 4)) == message.size() - 4);
+  CHECK(received == message);
+  CHECK(client_stream.pending() == 0);
+  CHECK(client_stream.buffered_ciphertext() > message.size());
+
+  CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == message.size());
+  CHECK(received == message);
+  CHECK(client_stream.pending() == 0);
+  CHECK(client_stream.buffered_ciphertext() == 0);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "read into dynamic buffer") {
+  const std::string message = "Der er et yndigt land";
+  const std::size_t messages = 3;
+  for (std::size_t i = 0; i < messages; ++i) {
+    net::write(server.stream, net::buffer(message));
+  }
+
+  std::string received;
+  SECTION("sync") {
+    while (received.size() < messages * message.size()) {
+      CHECK(client_stream.read_some(net::dynamic_buffer(received)) > 0);
+    }
+  }
+
+  SECTION("async") {
+    std::function<void(const wintls::error_code&, std::size_t)> handler = [&](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      if (received.size() < messages * message.size()) {
+        client_stream.async_read_some(net::dynamic_buffer(received), handler);
+      }
+    };
+    client_stream.async_read_some(net::dynamic_buffer(received), handler);
+    io_context.run();
+  }
+
+  SECTION("maximum size") {
+    CHECK(client_stream.read_some(net::dynamic_buffer(received, 4)) == 4);
+    wintls::error_code ec;
+    CHECK(client_stream.read_some(net::dynamic_buffer(received, 4), ec) == 0);
+    CHECK(ec == net::error::no_buffer_space);
+    bool completed = false;
+    client_stream.async_read_some(net::dynamic_buffer(received, 4), [&completed](const wintls::error_code& error, std::size_t size) {
+      CHECK(error == net::error::no_buffer_space);
+      CHECK(size == 0);
+      completed = true;
+    });
+    CHECK_FALSE(completed);
+    io_context.run();
+    CHECK(completed);
+    while (received.size() < messages * message.size()) {
+      client_stream.read_some(net::dynamic_buffer(received));
+    }
+  }
+
+  CHECK(received == message + message + message);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "adaptive read ahead") {
+  // Invalid bounds are rejected, leaving the bounds unchanged
+  wintls::error_code error{};
+  client_stream.set_adaptive_read_ahead(0, 0x10000, error);
+  CHECK(error == net::error::invalid_argument);
+  error = {};
+  client_stream.set_adaptive_read_ahead(0x10000, 0x100, error);
+  CHECK(error == net::error::invalid_argument);
+  CHECK_THROWS(client_stream.set_adaptive_read_ahead(0, 0x100));
+
+  client_stream.set_adaptive_read_ahead(0x100, 0x10000);
+
+  const std::string message(1000, 'x');
+  const std::size_t messages = 32;
+  for (std::size_t i = 0; i < messages; ++i) {
+    net::write(server.stream, net::buffer(message));
+  }
+
+  const auto reads_before = client_stream.next_layer().nread();
+  std::string received(messages * message.size(), '\0');
+  net::read(client_stream, net::buffer(&received[0], received.size()));
+  CHECK(received == std::string(messages * message.size(), 'x'));
+
+  // Starting out small, the amount read ahead grows with the bulk
+  // data received, needing fewer reads than records
+  CHECK(client_stream.next_layer().nread() - reads_before < messages);
+  CHECK(client_stream.memory_usage().decrypt <= 0x10000);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "read record") {
+  const std::string first = "Der er et yndigt land";
+  const std::string second = "det står med brede bøge";
+  net::write(server.stream, net::buffer(first));
+  net::write(server.stream, net::buffer(second));
+
+  auto to_string = [](const net::const_buffer& record) {
+    return std::string(static_cast<const char*>(record.data()), record.size());
+  };
+
+  SECTION("sync") {
+    CHECK(to_string(client_stream.read_record()) == first);
+    CHECK(to_string(client_stream.read_record()) == second);
+  }
+
+  SECTION("async") {
+    std::vector<std::string> received;
+    std::function<void(const wintls::error_code&, net::const_buffer)> handler = [&](const wintls::error_code& ec, net::const_buffer record) {
+      REQUIRE_FALSE(ec);
+      received.push_back(to_string(record));
+      if (received.size() < 2) {
+        client_stream.async_read_record(handler);
+      }
+    };
+    client_stream.async_read_record(handler);
+    io_context.run();
+    CHECK(received == std::vector<std::string>{first, second});
+  }
+
+  SECTION("after partial read") {
+    std::string received(4, '\0');
+    CHECK(client_stream.read_some(net::buffer(&received[0], received.size())) == received.size());
+    // The rest of the record partially read is returned first
+    CHECK(received + to_string(client_stream.read_record()) == first);
+    CHECK(to_string(client_stream.read_record()) == second);
+  }
+}
+
+TEST_CASE_METHOD(connected_stream<>, "multiple records per write") {
+  // Larger than a single record, but within the maximum write size
+  const std::string message(wintls::default_stream_traits::max_write_size, 'x');
+  const auto writes = client_stream.next_layer().nwrite();
+
+  SECTION("sync") {
+    CHECK(client_stream.write_some(net::buffer(message)) == message.size());
+  }
+
+  SECTION("async") {
+    std::size_t written = 0;
+    client_stream.async_write_some(net::buffer(message), [&written](const wintls::error_code& ec, std::size_t length) {
+      REQUIRE_FALSE(ec);
+      written = length;
+    });
+    io_context.run();
+    CHECK(written == message.size());
+  }
+
+  // All records are written to the next layer at once
+  CHECK(client_stream.next_layer().nwrite() == writes + 1);
+  std::string received(message.size(), '\0');
+  net::read(server.stream, net::buffer(&received[0], received.size()));
+  CHECK(received == message);
+}
+
+struct pipelined_stream_traits : wintls::default_stream_traits {
+  static constexpr bool pipeline_writes = true;
+};
+
+TEST_CASE_METHOD(connected_stream<pipelined_stream_traits>, "pipelined writes") {
+  std::string message(3 * wintls::default_stream_traits::max_write_size, '\0');
+  for (std::size_t i = 0; i < message.size(); ++i) {
+    message[i] = static_cast<char>('a' + i % 26);
+  }
+  const auto writes = client_stream.next_layer().nwrite();
+
+  SECTION("write") {
+    std::size_t written = 0;
+    net::async_write(client_stream, net::buffer(message), [&written](const wintls::error_code& ec, std::size_t length) {
+      REQUIRE_FALSE(ec);
+      written = length;
+    });
+    io_context.run();
+    CHECK(written == message.size());
+
+    // The records of each write are still written to the next layer
+    // at once
+    CHECK(client_stream.next_layer().nwrite() == writes + 3);
+    std::string received(message.size(), '\0');
+    net::read(server.stream, net::buffer(&received[0], received.size()));
+    CHECK(received == message);
+  }
+
+  SECTION("error reported by the following operation") {
+    server.stream.next_layer().close();
+    std::size_t written = 0;
+    wintls::error_code flush_error;
+    client_stream.async_write_some(net::buffer(message), [this, &written, &flush_error](const wintls::error_code& ec, std::size_t length) {
+      // Completed once the write has been started
+      REQUIRE_FALSE(ec);
+      written = length;
+      client_stream.async_flush([&flush_error](const wintls::error_code& error) {
+        flush_error = error;
+      });
+    });
+    io_context.run();
+    CHECK(written == wintls::default_stream_traits::max_write_size);
+    CHECK(flush_error);
+  }
+
+  SECTION("error reported by shutdown") {
+    server.stream.next_layer().close();
+    wintls::error_code shutdown_error;
+    client_stream.async_write_some(net::buffer(message), [this, &shutdown_error](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      client_stream.async_shutdown([&shutdown_error](const wintls::error_code& error) {
+        shutdown_error = error;
+      });
+    });
+    io_context.run();
+    CHECK(shutdown_error);
+
+    // No close_notify is written after the failed write
+    CHECK(client_stream.next_layer().nwrite() == writes + 1);
+  }
+
+  SECTION("stream reset while writing behind") {
+    std::size_t written = 0;
+    client_stream.async_write_some(net::buffer(message), [this, &written](const wintls::error_code& ec, std::size_t length) {
+      REQUIRE_FALSE(ec);
+      written = length;
+      client_stream.reset();
+    });
+    io_context.run();
+    CHECK(written == wintls::default_stream_traits::max_write_size);
+
+    // The records are still written in full
+    std::string received(written, '\0');
+    net::read(server.stream, net::buffer(&received[0], received.size()));
+    CHECK(received == message.substr(0, written));
+  }
+
+  SECTION("stream destroyed while writing behind") {
+    allocation_counter counter;
+    {
+      echo_server<asio_ssl_server_stream> other_server(io_context);
+      auto stream = std::make_unique<wintls::basic_stream<test_stream, pipelined_stream_traits>>(io_context, client_ctx, counting_allocator<char>(counter));
+      stream->next_layer().connect(other_server.stream.next_layer());
+
+      auto handshake_result = other_server.handshake();
+      stream->handshake(wintls::handshake_type::client);
+      REQUIRE_FALSE(handshake_result.get());
+
+      bool completed = false;
+      stream->async_write_some(net::buffer(message), [&stream, &completed](const wintls::error_code& ec, std::size_t) {
+        REQUIRE_FALSE(ec);
+        completed = true;
+        stream.reset();
+      });
+      io_context.run();
+      CHECK(completed);
+    }
+
+    // The records written behind are freed once the write is done
+    CHECK(counter.allocated == counter.deallocated);
+  }
+
+  SECTION("several operations waiting") {
+    std::size_t flushed = 0;
+    client_stream.async_write_some(net::buffer(message), [this, &flushed](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      // Both wait for the write still in progress
+      for (int i = 0; i < 2; ++i) {
+        client_stream.async_flush([&flushed](const wintls::error_code& error) {
+          REQUIRE_FALSE(error);
+          ++flushed;
+        });
+      }
+    });
+    io_context.run();
+    CHECK(flushed == 2);
+  }
+}
+
+TEST_CASE_METHOD(connected_stream<>, "prepared writes") {
+  const std::string message = "Der er et yndigt land";
+  auto buffer = client_stream.prepare_write(message.size() * 2);
+  REQUIRE(buffer.size() == message.size() * 2);
+  // Only the data actually serialized into the buffer is written
+  net::buffer_copy(buffer, net::buffer(message));
+
+  SECTION("sync") {
+    CHECK(client_stream.commit_write(message.size()) == message.size());
+  }
+
+  SECTION("async") {
+    std::size_t written = 0;
+    client_stream.async_commit_write(message.size(), [&written](const wintls::error_code& ec, std::size_t length) {
+      REQUIRE_FALSE(ec);
+      written = length;
+    });
+    io_context.run();
+    CHECK(written == message.size());
+  }
+
+  std::string received(message.size(), '\0');
+  net::read(server.stream, net::buffer(&received[0], received.size()));
+  CHECK(received == message);
+
+  // The buffer is limited to a single record
+  CHECK(client_stream.prepare_write(0x100000).size() < 0x100000);
+  CHECK(client_stream.commit_write(0) == 0);
+
+  // Committing requires a prepared buffer
+  wintls::error_code error{};
+  CHECK(client_stream.commit_write(message.size(), error) == 0);
+  CHECK(error == net::error::invalid_argument);
+
+  bool completed = false;
+  client_stream.async_commit_write(message.size(), [&completed](const wintls::error_code& ec, std::size_t length) {
+    CHECK(ec == net::error::invalid_argument);
+    CHECK(length == 0);
+    completed = true;
+  });
+  CHECK_FALSE(completed);
+  io_context.restart();
+  io_context.run();
+  CHECK(completed);
+
+  // Committing more than the size of the buffer prepared fails
+  // without writing anything
+  const auto writes = client_stream.next_layer().nwrite();
+  buffer = client_stream.prepare_write(message.size());
+  error = {};
+  CHECK(client_stream.commit_write(buffer.size() + 1, error) == 0);
+  CHECK(error == net::error::invalid_argument);
+
+  buffer = client_stream.prepare_write(message.size());
+  completed = false;
+  client_stream.async_commit_write(buffer.size() + 1, [&completed](const wintls::error_code& ec, std::size_t length) {
+    CHECK(ec == net::error::invalid_argument);
+    CHECK(length == 0);
+    completed = true;
+  });
+  io_context.restart();
+  io_context.run();
+  CHECK(completed);
+
+  CHECK(client_stream.next_layer().nwrite() == writes);
+}
+
+TEST_CASE_METHOD(connected_stream<>, "cork mode") {
+  const std::string first = "Der er et yndigt land";
+  const std::string second = "det står med brede bøge";
+  const auto writes = client_stream.next_layer().nwrite();
+  bool shut_down = false;
+
+  SECTION("explicit flush") {
+    client_stream.set_cork(true);
+    net::write(client_stream, net::buffer(first));
+    net::write(client_stream, net::buffer(second));
+    CHECK(client_stream.next_layer().nwrite() == writes);
+    client_stream.flush();
+  }
+
+  SECTION("flushed after delay") {
+    client_stream.set_cork(true, std::chrono::milliseconds(1));
+    net::async_write(client_stream, net::buffer(first), [&](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      net::async_write(client_stream, net::buffer(second), [](const wintls::error_code& error, std::size_t) {
+        REQUIRE_FALSE(error);
+      });
+    });
+    io_context.run();
+  }
+
+  SECTION("flushed after delay by moved stream") {
+    client_stream.set_cork(true, std::chrono::milliseconds(1));
+    std::unique_ptr<wintls::stream<test_stream>> moved_stream;
+    net::async_write(client_stream, net::buffer(first), [&](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      moved_stream.reset(new wintls::stream<test_stream>(std::move(client_stream)));
+      net::async_write(*moved_stream, net::buffer(second), [](const wintls::error_code& error, std::size_t) {
+        REQUIRE_FALSE(error);
+      });
+    });
+    io_context.run();
+    client_stream = std::move(*moved_stream);
+  }
+
+  SECTION("stream reset while flushing after delay") {
+    client_stream.set_cork(true, std::chrono::milliseconds(1));
+    net::async_write(client_stream, net::buffer(first), [&](const wintls::error_code& ec, std::size_t) {
+      REQUIRE_FALSE(ec);
+      net::async_write(client_stream, net::buffer(second), [](const wintls::error_code& error, std::size_t) {
+        REQUIRE_FALSE(error);
+      });
+    });
+    while (client_stream.next_layer().nwrite() == writes) {
+      io_context.run_one();
+    }
+    // The records are still written in full
+    client_stream.reset();
+    io_context.run();
+  }
+
+  SECTION("prepared write") {
+    client_stream.set_cork(true);
+    net::write(client_stream, net::buffer(first));
+    auto buffer = client_stream.prepare_write(second.size());
+    net::buffer_copy(buffer, net::buffer(second));
+    // The corked data is written first, along with the prepared data
+    CHECK(client_stream.commit_write(second.size()) == second.size());
+  }
+
+  SECTION("flushed by shutdown") {
+    client_stream.set_cork(true);
+    net::write(client_stream, net::buffer(first));
+    net::write(client_stream, net::buffer(second));
+    client_stream.shutdown();
+    shut_down = true;
+  }
+
+  SECTION("flushed by async shutdown") {
+    client_stream.set_cork(true);
+    net::write(client_stream, net::buffer(first));
+    net::write(client_stream, net::buffer(second));
+    client_stream.async_shutdown([](const wintls::error_code& ec) {
+      REQUIRE_FALSE(ec);
+    });
+    io_context.run();
+    shut_down = true;
+  }
+
+  // Both writes are sent by a single write to the next layer, ahead
+  // of the close_notify if shut down
+  CHECK(client_stream.next_layer().nwrite() == writes + (shut_down ? 2 : 1));
+  std::string received(first.size() + second.size(), '\0');
+  net::read(server.stream, net::buffer(&received[0], received.size()));
+  CHECK(received == first + second);
+
+  if (shut_down) {
+    char c = 0;
+    error_code ec{};
+    net::read(server.stream, net::buffer(&c, 1), ec);
+    CHECK(ec == net::error::eof);
+  }
+}
+
+TEST_CASE_METHOD(connected_stream<>, "queued writes") {
+  client_stream.set_write_queue(true);
+  const auto writes = client_stream.next_layer().nwrite();
+
+  // Each producer writes its messages in bursts, starting the next
+  // burst once the first write of the previous one has completed
+  constexpr std::size_t producers = 8;
+  constexpr std::size_t messages = 100;
+  constexpr std::size_t burst = 4;
+  std::vector<std::vector<std::string>> sent(producers);
+  std::size_t total_size = 0;
+  for (std::size_t producer = 0; producer < producers; ++producer) {
+    for (std::size_t i = 0; i < messages; ++i) {
+      std::string message = std::to_string(producer) + ":" + std::to_string(i) + ":";
+      message.append((producer * 131 + i * 71) % 2000, static_cast<char>('a' + producer));
+      message += "\n";
+      total_size += message.size();
+      sent[producer].push_back(std::move(message));
+    }
+  }
+
+  auto strand = net::make_strand(io_context);
+  std::vector<std::size_t> started(producers, 0);
+  std::size_t completed = 0;
+  std::function<void(std::size_t)> produce = [&](std::size_t producer) {
+    for (std::size_t i = 0; i < burst && started[producer] < messages; ++i) {
+      const std::string& message = sent[producer][started[producer]++];
+      const bool next_burst = i == 0;
+      client_stream.async_write_some(net::buffer(message), net::bind_executor(strand, [&, producer, next_burst](const wintls::error_code& ec, std::size_t length) {
+        REQUIRE_FALSE(ec);
+        CHECK(length == message.size());
+        ++completed;
+        if (next_burst) {
+          produce(producer);
+        }
+      }));
+    }
+  };
+  for (std::size_t producer = 0; producer < producers; ++producer) {
+    net::post(strand, [&produce, producer]() {
+      produce(producer);
+    });
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([this]() {
+      io_context.run();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  CHECK(completed == producers * messages);
+
+  // The data of the writes queued are coalesced into fewer records
+  CHECK(client_stream.next_layer().nwrite() - writes < producers * messages);
+
+  // Each message is received whole and in the order written by its
+  // producer
+  std::string received(total_size, '\0');
+  net::read(server.stream, net::buffer(&received[0], received.size()));
+  std::vector<std::size_t> next(producers, 0);
+  std::size_t pos = 0;
+  while (pos < received.size()) {
+    const auto end = received.find('\n', pos);
+    REQUIRE(end != std::string::npos);
+    const std::string message = received.substr(pos, end + 1 - pos);
+    const std::size_t producer = std::stoul(message);
+    REQUIRE(producer < producers);
+    REQUIRE(next[producer] < messages);
+    CHECK(message == sent[producer][next[producer]++]);
+    pos = end + 1;
+  }
+  CHECK(next == std::vector<std::size_t>(producers, messages));
+}
+
+TEST_CASE_METHOD(connected_stream<>, "queued writes use the handler allocator") {
+  client_stream.set_write_queue(true);
+  allocation_counter counter;
+  std::size_t completed = 0;
+
+  const std::string message = "Der er et yndigt land";
+  for (int i = 0; i < 3; ++i) {
+    client_stream.async_write_some(net::buffer(message), counting_write_handler{&counter, &completed});
+  }
+  // The writes waiting behind the first one are kept in memory
+  // allocated using the allocator of their handlers
+  CHECK(counter.allocated > 0);
+  io_context.run();
+  CHECK(completed == 3);
+  CHECK(counter.allocated == counter.deallocated);
+
+  std::string received(3 * message.size(), '\0');
+  net::read(server.stream, net::buffer(&received[0], received.size()));
+  CHECK(received == message + message + message);
+}
@@ -203,9 +203,18 @@ struct stream::run_write_op
         ++in_->nwrite;
         auto const upcall = [&](error_code ec, std::size_t n)
         {
+            // Like the read operation, the handler is invoked
+            // through its associated executor, if any
+            auto ex = net::get_associated_executor(
+                h, in_->ioc.get_executor());
             net::post(
                 in_->ioc.get_executor(),
-                std::bind(std::move(h), ec, n));
+                [ex, h = std::move(h), ec, n]() mutable
+                {
+                    net::dispatch(
+                        ex,
+                        std::bind(std::move(h), ec, n));
+                });
         };
 
         // test failure